@@ -1,19 +1,29 @@
 #include "Pipeline.h"
 
+#include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
 #include <sys/signal.h>
 #include <unistd.h>
 
 #include "ShellException.h"
 #include "history.h"
+#include "job_table.h"
 #include "signal_handlers.h"
 #include "utility.h"
 
 using namespace std;
 
-Pipeline::Pipeline(string& cmd) : cmd(cmd), is_bg(0), pgid(-1) {}
+Pipeline::Pipeline(string& cmd) : cmd(cmd), is_bg(0), pgid(-1), out_fd(-1), job_id(0) {}
 
-Pipeline::Pipeline(vector<Command*>& cmds) : cmds(cmds), is_bg(0), pgid(-1), num_active(cmds.size()), status(RUNNING) {}
+Pipeline::Pipeline(vector<Command*>& cmds) : cmds(cmds), is_bg(0), pgid(-1), num_active(cmds.size()), status(RUNNING), out_fd(-1), job_id(0) {}
+
+// The pipeline owns its commands
+Pipeline::~Pipeline() {
+    for (Command* c : this->cmds) {
+        delete c;
+    }
+}
 
 // Parses the command string into a vector of Command objects
 void Pipeline::parse() {
@@ -24,93 +34,189 @@ void Pipeline::parse() {
     }
     vector<string> piped_cmds = split(this->cmd, '|');  // First, split the command on the basis of '|'
 
+    vector<Command*> cmds;
     try {
-        vector<Command*> cmds;
         for (int i = 0; i < (int)piped_cmds.size(); i++) {
             trim(piped_cmds[i]);
             if (piped_cmds[i] == "") {
                 throw ShellException("Empty command in pipe");
             }
             Command* c = new Command(piped_cmds[i]);
+            cmds.push_back(c);  // Before parsing, so that it is deleted if parsing fails
             c->parse();
             if (c->args.size() == 0) {
                 throw ShellException("Empty command");
             }
-            cmds.push_back(c);
         }
         this->cmds = cmds;
         this->num_active = cmds.size();
         this->status = RUNNING;  // For simplicity, we directly set the status of the pipleing to RUNNING
     } catch (ShellException& e) {
+        for (Command* c : cmds) {
+            delete c;
+        }
         throw;
     }
 }
 
+// Starts c with the given stdin and stdout (-1 to keep the shell's) in process group pgid (0 for a new group of its
+// own). posix_spawn does not copy the page tables of the shell, which grow with its history and jobs, as fork does.
+// Redirections in the command take precedence over the pipes. Their files are opened by the shell rather than by the
+// spawn, so that a failure names the file. Returns -1 if it could not be started
+pid_t spawnCommand(Command* c, int in_fd, int out_fd, pid_t pgid) {
+    int file_in = -1, file_out = -1;
+    if (c->input_file != "") {
+        file_in = open(c->input_file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file_in < 0) {
+            perror(c->input_file.c_str());
+            return -1;
+        }
+        in_fd = file_in;
+    }
+    if (c->output_file != "") {
+        file_out = open(c->output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file_out < 0) {
+            perror(c->output_file.c_str());
+            if (file_in >= 0) {
+                close(file_in);
+            }
+            return -1;
+        }
+        out_fd = file_out;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+
+    // Ctrl-C and Ctrl-Z are handled (or ignored by multiWatch) in the shell, the command gets the default behaviour.
+    // SIGCHLD is blocked by the shell while starting the pipeline
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t def, mask;
+    sigemptyset(&def);
+    sigaddset(&def, SIGINT);
+    sigaddset(&def, SIGTSTP);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    vector<char*> argv;
+    for (auto& arg : c->args) {
+        argv.push_back((char*)arg.c_str());
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    int ret = posix_spawnp(&pid, argv[0], &actions, &attr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (file_in >= 0) {
+        close(file_in);
+    }
+    if (file_out >= 0) {
+        close(file_out);
+    }
+    if (ret != 0) {
+        errno = ret;
+        perror(argv[0]);
+        return -1;
+    }
+    return pid;
+}
+
+// history prints what is in the memory of the shell, so it still needs a fork
+pid_t forkHistory(Command* c, int in_fd, int out_fd, pid_t pgid) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        throw ShellException("Unable to fork");
+    }
+    if (pid == 0) {
+        unblockSIGCHLD();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        setpgid(0, pgid);
+        if (in_fd >= 0) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        c->io_redirect();
+        printHistory();
+        exit(0);
+    }
+    return pid;
+}
+
 // Excetutes all the commands in the pipeline
 void Pipeline::executePipeline(bool isMultiwatch) {
-    pid_t fg_pgid = 0;
-    int new_pipe[2], old_pipe[2];
+    pid_t fg_pgid = 0;  // The pid of the first command started, all others join its process group
+    int new_pipe[2], old_pipe[2], watch_pipe[2];
 
+    // In case of multiWatch, the output of the last command goes to a pipe read by the shell. All pipes are
+    // close-on-exec, so that only the commands they are duplicated into hold them open, which would delay the EOF.
+    // Created first, so that failing leaves nothing to undo
+    if (isMultiwatch && pipe2(watch_pipe, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        throw ShellException("Unable to create pipe");
+    }
+
+    // The pipelines of multiWatch belong to it, the others are deleted by the job table once reported done
+    job_table.add(this, !isMultiwatch);
     blockSIGCHLD();  // Block SIGCHLD signal to avoid race conditions
 
     int cmds_size = this->cmds.size();
+    this->num_active = cmds_size;  // The pipeline may be run again, as multiWatch -n does
+    this->status = RUNNING;
     for (int i = 0; i < cmds_size; i++) {
         if (i + 1 < cmds_size) {
-            int ret = pipe(new_pipe);  // Create the pipe
+            int ret = pipe2(new_pipe, O_CLOEXEC);  // Create the pipe
             if (ret < 0) {
-                perror("pipe");
+                perror("pipe2");
+                // The caller removes the job, so the commands already started are interrupted rather than left
+                // running untracked
+                if (i > 0) {
+                    close(old_pipe[0]);
+                    close(old_pipe[1]);
+                }
+                if (isMultiwatch) {
+                    close(watch_pipe[0]);
+                    close(watch_pipe[1]);
+                }
+                if (fg_pgid != 0) {
+                    kill(-fg_pgid, SIGINT);
+                    tcsetpgrp(STDIN_FILENO, getpid());
+                }
+                unblockSIGCHLD();
                 throw ShellException("Unable to create pipe");
             }
         }
-        pid_t cpid = fork();
-        if (cpid < 0) {
-            perror("fork");
-            throw ShellException("Unable to fork");
+        int in_fd = (i > 0) ? old_pipe[0] : -1;
+        int out_fd = (i + 1 < cmds_size) ? new_pipe[1] : (isMultiwatch ? watch_pipe[1] : -1);
+        Command* c = this->cmds[i];
+        pid_t cpid;
+        if (c->args[0] == "history") {
+            cpid = forkHistory(c, in_fd, out_fd, fg_pgid);
+        } else {
+            cpid = spawnCommand(c, in_fd, out_fd, fg_pgid);
         }
-        if (cpid == 0) {  // Child process
-            unblockSIGCHLD();
-            // Revert signal handlers to default behaviour
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-
-            if (i == 0) {
-                fg_pgid = getpid();  // Get the pid of the first process to be set as the group id of all others in the pipeline
-            }
-            if (isMultiwatch && i + 1 == cmds_size) {  // Create the tmp file in case of multiWatch
-                this->cmds[i]->output_file = ".tmp." + to_string(fg_pgid) + ".txt";
-            }
-            this->cmds[i]->io_redirect();
-
-            if (i == 0) {
-                setpgrp();  // Set the process group id of the first process to be the same as its pid
-            } else {
-                setpgid(0, fg_pgid);                      // Set the process group id of all child processes to be the same as the first process
-                dup2(old_pipe[0], this->cmds[i]->fd_in);  // Input piping
-                close(old_pipe[0]);
-                close(old_pipe[1]);
-            }
-            if (i + 1 < cmds_size) {
-                dup2(new_pipe[1], this->cmds[i]->fd_out);  // Output piping
-                close(new_pipe[0]);
-                close(new_pipe[1]);
-            }
-
-            if (this->cmds[i]->args[0] == "history") {  // If the command is history, print the history
-                printHistory();
-                exit(0);
-            } else {
-                vector<char*> c_args = cstrArray(this->cmds[i]->args);
-                execvp(c_args[0], c_args.data());
-                perror("execvp");
-                exit(1);
-            }
-        } else {                        // Parent process (shell)
-            this->cmds[i]->pid = cpid;  // Set the pid of the command
-            if (i == 0) {
+        c->pid = cpid;  // Set the pid of the command
+        if (cpid < 0) {  // The rest of the pipeline still runs, as if the command had failed
+            this->num_active--;
+        } else {
+            if (fg_pgid == 0) {
                 fg_pgid = cpid;
                 this->pgid = cpid;
-                setpgid(cpid, fg_pgid);         // Avoiding race conditions
-                all_pipelines.push_back(this);  // Store this pipeline in the vector of all pipelines
+                setpgid(cpid, fg_pgid);  // Avoiding race conditions
 
                 // Reference: https://web.archive.org/web/20170701052127/https://www.usna.edu/Users/cs/aviv/classes/ic221/s16/lab/10/lab.html
                 // Give control of stdin to the running processes
@@ -118,22 +224,32 @@ void Pipeline::executePipeline(bool isMultiwatch) {
             } else {
                 setpgid(cpid, fg_pgid);
             }
-            if (i > 0) {
-                close(old_pipe[0]);
-                close(old_pipe[1]);
-            }
-            old_pipe[0] = new_pipe[0];
-            old_pipe[1] = new_pipe[1];
-
-            ind[cpid] = (int)all_pipelines.size() - 1;
+            job_table.addProcess(cpid, this->job_id);
+        }
+        if (i > 0) {
+            close(old_pipe[0]);
+            close(old_pipe[1]);
         }
+        old_pipe[0] = new_pipe[0];
+        old_pipe[1] = new_pipe[1];
+    }
+    if (fg_pgid == 0) {  // Nothing could be started
+        this->pgid = 0;
+        this->status = DONE;
+        job_table.remove(this->job_id);
+    }
+
+    if (isMultiwatch) {
+        close(watch_pipe[1]);
+        fcntl(watch_pipe[0], F_SETFL, O_NONBLOCK);  // So that multiWatch can drain it without blocking
+        this->out_fd = watch_pipe[0];
     }
 
-    if (this->is_bg || isMultiwatch) {  // For background processes, we don't wait for them
+    if (this->is_bg || isMultiwatch || fg_pgid == 0) {  // For background processes, we don't wait for them
         unblockSIGCHLD();
     } else {
         waitForForegroundProcess(fg_pgid);
-        if (all_pipelines.back()->status == STOPPED) {  // If Ctrl-Z was sent, now send SIGCONT to continue the process immediately in the background
+        if (this->status == STOPPED) {  // If Ctrl-Z was sent, now send SIGCONT to continue the process immediately in the background
             kill(-fg_pgid, SIGCONT);
         }
     }
@@ -20,9 +20,12 @@ class Pipeline {
     pid_t pgid;             // The process group ID of processes in the pipeline
     int num_active;         // The number of active processes in the pipeline
     int status;             // The status of the pipeline - RUNNING, STOPPED, or DONE
+    int out_fd;             // Read end of the pipe from the last command when run by multiWatch, -1 otherwise
+    int job_id;             // Id in the job table, 0 if it is not in it
 
     Pipeline(string& cmd);
     Pipeline(vector<Command*>& cmds);
+    ~Pipeline();
     void parse();
     void executePipeline(bool isMultiwatch = false);
     friend ostream& operator<<(ostream& os, const Pipeline& p);
@@ -0,0 +1,92 @@
+/*
+    Measures how long starting one pipeline stage takes in the shell with fork + execvp
+    (as vash used to) and with posix_spawnp (as executePipeline does now), while the heap
+    of the process grows the way a long running shell's does: a full history and then
+    more and more memory that has been touched. The time is how long the shell is busy
+    starting the command, from the call until it returns.
+
+    Usage: bench_spawn [max_heap_mb]   (default 512)
+*/
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const int SPAWNS = 200;          // Stages started for each heap size and method
+const int HISTORY_SIZE = 10000;  // Same as the history of the shell
+const size_t CHUNK = 1 << 20;
+
+char* child_argv[] = {(char*)"true", nullptr};
+
+double forkStage() {
+    auto t0 = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(child_argv[0], child_argv);
+        _exit(1);
+    }
+    double us = chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count();
+    waitpid(pid, NULL, 0);
+    return us;
+}
+
+double spawnStage() {
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    auto t0 = chrono::steady_clock::now();
+    pid_t pid;
+    if (posix_spawnp(&pid, child_argv[0], NULL, &attr, child_argv, environ) != 0) {
+        perror("posix_spawnp");
+        exit(1);
+    }
+    double us = chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count();
+    posix_spawnattr_destroy(&attr);
+    waitpid(pid, NULL, 0);
+    return us;
+}
+
+double average(double (*stage)()) {
+    double total = 0;
+    for (int i = 0; i < SPAWNS; i++) {
+        total += stage();
+    }
+    return total / SPAWNS;
+}
+
+int main(int argc, char* argv[]) {
+    size_t max_mb = (argc > 1) ? atol(argv[1]) : 512;
+
+    deque<string> history;
+    for (int i = 0; i < HISTORY_SIZE; i++) {
+        history.push_back("ls -l /usr/bin | grep " + to_string(i) + " | sort -r > out" + to_string(i) + ".txt");
+    }
+
+    printf("%10s %14s %14s %8s\n", "heap (MB)", "fork (us)", "spawn (us)", "speedup");
+    vector<char*> heap;
+    for (size_t mb = 0; mb <= max_mb; mb = (mb == 0) ? 16 : mb * 2) {
+        while (heap.size() < mb) {
+            char* chunk = (char*)malloc(CHUNK);
+            memset(chunk, 1, CHUNK);  // Only touched pages are mapped and have to be copied by fork
+            heap.push_back(chunk);
+        }
+        double fork_us = average(forkStage);
+        double spawn_us = average(spawnStage);
+        printf("%10zu %14.1f %14.1f %7.1fx\n", mb, fork_us, spawn_us, fork_us / spawn_us);
+        fflush(stdout);
+    }
+    for (char* chunk : heap) {
+        free(chunk);
+    }
+    return 0;
+}
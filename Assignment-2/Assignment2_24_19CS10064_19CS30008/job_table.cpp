@@ -0,0 +1,160 @@
+#include "job_table.h"
+
+#include <signal.h>
+
+#include "ShellException.h"
+
+using namespace std;
+
+JobTable job_table;
+
+// Blocks SIGCHLD while the table changes, and restores the previous mask after, so that these can be nested
+void blockReaper(sigset_t* old) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, old);
+}
+
+void restoreReaper(sigset_t* old) {
+    sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+uint32_t pidHash(pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) >> (32 - PID_BITS);
+}
+
+JobTable::JobTable() : num_free(MAX_JOBS), max_id(0), num_pids(0) {
+    for (int id = 0; id <= MAX_JOBS; id++) {
+        jobs[id] = NULL;
+        owned[id] = false;
+    }
+    for (int i = 0; i < MAX_JOBS; i++) {
+        free_ids[i] = MAX_JOBS - i;  // The lowest ids are handed out first
+    }
+    for (int i = 0; i < PID_SLOTS; i++) {
+        pids[i] = 0;
+    }
+}
+
+// Adds p to the table with room for the processes of all its commands and returns its job id. If the table is full,
+// finished jobs are reclaimed even if they have not been reported. An owned pipeline is deleted when reclaimed
+int JobTable::add(Pipeline* p, bool is_owned) {
+    sigset_t old;
+    blockReaper(&old);
+    if (num_free == 0 || num_pids + (int)p->cmds.size() > PID_SLOTS / 2) {
+        reclaimDone();
+    }
+    if (num_free == 0 || num_pids + (int)p->cmds.size() > PID_SLOTS / 2) {
+        restoreReaper(&old);
+        throw ShellException("Too many jobs");
+    }
+    int id = free_ids[--num_free];
+    jobs[id] = p;
+    owned[id] = is_owned;
+    p->job_id = id;
+    max_id = max(max_id, id);
+    num_pids += p->cmds.size();  // Reserved for addProcess
+    restoreReaper(&old);
+    return id;
+}
+
+// Maps pid to job id, replacing a finished process that had the same pid
+void JobTable::addProcess(pid_t pid, int id) {
+    sigset_t old;
+    blockReaper(&old);
+    int i = pidHash(pid);
+    while (pids[i] != 0 && pids[i] != pid) {
+        i = (i + 1) & (PID_SLOTS - 1);
+    }
+    pids[i] = pid;
+    pid_jobs[i] = id;
+    restoreReaper(&old);
+}
+
+// Removes the job from the table without deleting its pipeline, its id can be given out again. 0 is ignored
+void JobTable::remove(int id) {
+    if (id <= 0 || jobs[id] == NULL) {
+        return;
+    }
+    sigset_t old;
+    blockReaper(&old);
+    Pipeline* p = jobs[id];
+    for (Command* c : p->cmds) {
+        int i = (c->pid > 0) ? slotOf(c->pid) : -1;
+        if (i >= 0 && pid_jobs[i] == id) {  // The pid may already belong to a newer job
+            erasePid(c->pid);
+        }
+    }
+    num_pids -= p->cmds.size();
+    p->job_id = 0;
+    jobs[id] = NULL;
+    free_ids[num_free++] = id;
+    while (max_id > 0 && jobs[max_id] == NULL) {
+        max_id--;
+    }
+    restoreReaper(&old);
+}
+
+// Removes the finished jobs and deletes their pipelines, once they have been reported by jobs
+void JobTable::reclaimDone() {
+    sigset_t old;
+    blockReaper(&old);
+    for (int id = 1; id <= max_id; id++) {
+        Pipeline* p = jobs[id];
+        if (p != NULL && owned[id] && p->status == DONE) {
+            remove(id);
+            delete p;
+        }
+    }
+    restoreReaper(&old);
+}
+
+Pipeline* JobTable::get(int id) {
+    return jobs[id];
+}
+
+// Job of the process, NULL if it is not in the table. Called from the SIGCHLD handler
+Pipeline* JobTable::find(pid_t pid) {
+    int i = slotOf(pid);
+    return (i < 0) ? NULL : jobs[pid_jobs[i]];
+}
+
+int JobTable::maxId() {
+    return max_id;
+}
+
+int JobTable::slotOf(pid_t pid) {
+    int i = pidHash(pid);
+    while (pids[i] != 0) {
+        if (pids[i] == pid) {
+            return i;
+        }
+        i = (i + 1) & (PID_SLOTS - 1);
+    }
+    return -1;
+}
+
+// Linear probing without tombstones: the entries after the erased one that would no longer be found are moved back
+void JobTable::erasePid(pid_t pid) {
+    int i = slotOf(pid);
+    if (i < 0) {
+        return;
+    }
+    int j = i;
+    while (true) {
+        j = (j + 1) & (PID_SLOTS - 1);
+        if (pids[j] == 0) {
+            break;
+        }
+        int home = pidHash(pids[j]);
+        // The entry at j can fill the hole at i unless its home slot lies cyclically in (i, j]
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            pids[i] = pids[j];
+            pid_jobs[i] = pid_jobs[j];
+            i = j;
+        }
+    }
+    pids[i] = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __JOB_TABLE_H
+#define __JOB_TABLE_H
+
+#include <sys/types.h>
+
+#include "Pipeline.h"
+
+using namespace std;
+
+#define MAX_JOBS 1024  // Jobs that can be tracked at the same time
+#define PID_BITS 13
+#define PID_SLOTS (1 << PID_BITS)  // Capacity of the process to job map, kept at most half full
+
+// The jobs of the shell. Job ids are dense, finished ones go back on a free list, and processes are found in an open
+// addressing hash map from pid to job id. Everything is allocated up front, since the SIGCHLD handler looks up
+// processes and must not allocate. All changes are made with SIGCHLD blocked.
+class JobTable {
+   public:
+    JobTable();
+    int add(Pipeline* p, bool owned);
+    void addProcess(pid_t pid, int id);
+    void remove(int id);
+    void reclaimDone();
+    Pipeline* get(int id);
+    Pipeline* find(pid_t pid);
+    int maxId();
+
+   private:
+    Pipeline* jobs[MAX_JOBS + 1];  // Indexed by job id, 0 is not used
+    bool owned[MAX_JOBS + 1];      // Whether the pipeline is deleted by the table once reclaimed
+    int free_ids[MAX_JOBS];
+    int num_free;
+    int max_id;  // Highest job id in use
+
+    pid_t pids[PID_SLOTS];  // 0 for an empty slot
+    int pid_jobs[PID_SLOTS];
+    int num_pids;
+
+    int slotOf(pid_t pid);
+    void erasePid(pid_t pid);
+};
+
+extern JobTable job_table;
+
+#endif
@@ -1,22 +1,45 @@
 #include "multiWatch.h"
 
 #include <fcntl.h>
-#include <sys/inotify.h>
-#include <sys/stat.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <cmath>
+#include <deque>
+
 #include "ShellException.h"
+#include "job_table.h"
+#include "signal_handlers.h"
 #include "utility.h"
 
 using namespace std;
 
-int inotify_fd;           // The inotify instance to monitor the file descriptors
-map<pid_t, int> pgid_wd;  // Map process group id to watch descriptor
-map<int, int> wd_ind;     // Map watch descriptor to index in the vector
+const int READ_CHUNK = 1 << 16;  // Bytes read from a pipe at a time when the output cannot be spliced to
+const int MAX_EVENTS = 64;
+const int MAX_WATCH_RUNS = 8;            // Pipelines run at the same time by multiWatch -n, the others wait for a slot
+const double MIN_WATCH_INTERVAL = 0.01;  // Seconds
+const double MAX_WATCH_INTERVAL = 86400;  // A day, also keeps the conversion to the timerfd's time_t defined
+const uint64_t TIMER_TAG = ~0ULL;        // epoll tag of the timerfd
+
+vector<pid_t> watch_pgids;  // Process group of the current run of each multiWatch command, 0 if it is not running
+volatile sig_atomic_t watch_interrupted = 0;  // Set on Ctrl-C, stops multiWatch -n from starting new runs
+
+// State of a multiWatch command across its runs
+struct WatchedCommand {
+    Pipeline* p;
+    int pidfd;       // To know when the last command of the current run exits, -1 if not running or not supported
+    bool waiting;    // Waiting for a free slot to run
+    double started;  // When the current run started
+};
 
 // Creates pipelines for all commands inside quotes for multiWatch
-vector<Pipeline*> parseMultiWatch(string cmd, string& output_file) {
+vector<Pipeline*> parseMultiWatch(string cmd, string& output_file, double& interval) {
     trim(cmd);
     if (cmd.length() < 10) {  // Not multiWatch
         return vector<Pipeline*>();
@@ -25,6 +48,17 @@ vector<Pipeline*> parseMultiWatch(string cmd, string& output_file) {
     if (cmd.substr(0, 10) == "multiWatch") {
         cmd = cmd.substr(10);
         trim(cmd);
+        if (cmd.substr(0, 2) == "-n") {  // Run the commands again every interval seconds
+            cmd = cmd.substr(2);
+            trim(cmd);
+            char* end;
+            interval = strtod(cmd.c_str(), &end);
+            if (end == cmd.c_str() || !isfinite(interval) || interval < MIN_WATCH_INTERVAL || interval > MAX_WATCH_INTERVAL) {
+                throw ShellException("Invalid interval after -n");
+            }
+            cmd = cmd.substr(end - cmd.c_str());
+            trim(cmd);
+        }
         if (cmd.length()) {
             if (cmd.back() != ']') {
                 int i = cmd.length() - 1;
@@ -70,8 +104,15 @@ vector<Pipeline*> parseMultiWatch(string cmd, string& output_file) {
                 for (auto& command : commands) {
                     if (command != "") {
                         Pipeline* p = new Pipeline(command);  // Create a pipeline for each string inside quotes
-                        p->parse();
                         pipelines.push_back(p);
+                        try {
+                            p->parse();
+                        } catch (ShellException& e) {
+                            for (Pipeline* q : pipelines) {
+                                delete q;
+                            }
+                            throw;
+                        }
                     } else {
                         cout << "Empty command in multiWatch" << endl;
                     }
@@ -88,110 +129,306 @@ vector<Pipeline*> parseMultiWatch(string cmd, string& output_file) {
     return pipelines;
 }
 
-// Executes the multiWatch command by creating an inotify instance and monitoring the tmp files for output
-void executeMultiWatch(vector<Pipeline*>& pList, string output_file) {
-    inotify_fd = inotify_init();  // Initialize inotify instance
-    if (inotify_fd < 0) {
-        perror("inotify_init");
-        throw ShellException("Unable to create inotify instance");
+// Adds fd to the epoll instance. The tag is the index of its pipeline shifted left by one with the lowest bit set for
+// a pidfd, or TIMER_TAG for the timerfd
+void watchFd(int epoll_fd, int fd, uint64_t tag) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        throw ShellException("Unable to add to epoll instance");
     }
+}
 
-    vector<int> fds;  // To store file descriptos from the tmp files to read
-    for (int i = 0; i < (int)pList.size(); i++) {
-        pList[i]->executePipeline(true);
-        string tmpFile = ".tmp." + to_string(pList[i]->pgid) + ".txt";
-        int fd = open(tmpFile.c_str(), O_RDONLY);
-        if (fd < 0) {
-            // Handle race condition of file not being already created in the child process
-            int temp_fd = open(tmpFile.c_str(), O_CREAT, 0644);
-            if (temp_fd < 0) {
-                perror("open");
-                throw ShellException("Unable to open tmp file");
+void writeAll(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            close(temp_fd);
-            fd = open(tmpFile.c_str(), O_RDONLY);
+            perror("write");
+            throw ShellException("Unable to write output");
         }
-        fds.push_back(fd);
-        int wd = inotify_add_watch(inotify_fd, tmpFile.c_str(), IN_MODIFY);  // Add watch descriptor to inotify instance
-        if (wd < 0) {
-            perror("inotify_add_watch");
-            throw ShellException("Unable to add watch");
+        buf += n;
+        len -= n;
+    }
+}
+
+void writevAll(int fd, struct iovec* iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("writev");
+            throw ShellException("Unable to write output");
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
         }
-        pgid_wd[pList[i]->pgid] = wd;  // Map process group id to watch descriptor
-        wd_ind[wd] = i;                // Map watch descriptor to index in the vector
     }
+}
 
-    int num_running = pList.size();
+// Writes the header that goes before each chunk of output of a command, in a single writev
+void writeHeader(int out_fd, Pipeline* p) {
+    string ts = to_string(time(NULL));
+    string line(p->cmd.length() + ts.length() + 6, '-');
+    struct iovec iov[] = {{(void*)line.data(), line.length()}, {(void*)"\n\"", 2},      {(void*)p->cmd.data(), p->cmd.length()},
+                          {(void*)"\", ", 3},                 {(void*)ts.data(), ts.length()}, {(void*)" :\n", 3},
+                          {(void*)line.data(), line.length()}, {(void*)"\n", 1}};
+    writevAll(out_fd, iov, sizeof(iov) / sizeof(iov[0]));
+}
 
-    FILE* out_fp;
-    if (output_file == "") {
-        out_fp = stdout;
-    } else {
-        // Open output file for writing (if anything other than stdout)
-        out_fp = fopen(output_file.c_str(), "w");
-        if (out_fp == NULL) {
-            perror("fopen");
-            throw ShellException("Unable to open output file");
+// Moves up to len bytes from the pipe of p to out_fd and returns how many were moved. The data stays in the kernel
+// with splice, unless out_fd does not support it (a terminal or a file opened for appending), then it is copied
+// through buf. The pipe holds at least len bytes, so this waits for a slow out_fd instead of leaving them behind
+size_t forwardOutput(Pipeline* p, int out_fd, size_t len, vector<char>& buf, bool& use_splice) {
+    size_t moved = 0;
+    while (moved < len) {
+        ssize_t n;
+        if (use_splice) {
+            n = splice(p->out_fd, NULL, out_fd, NULL, len - moved, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL) {
+                use_splice = false;
+                continue;
+            }
+            // The non-blocking read end can make splice give up on a full out_fd, wait until it drains. After Ctrl-C
+            // the rest is dropped, so that a stuck out_fd cannot hold up the shell
+            if (n < 0 && errno == EAGAIN && !watch_interrupted) {
+                struct pollfd pfd = {out_fd, POLLOUT, 0};
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                    perror("poll");
+                    throw ShellException("Unable to forward output");
+                }
+                continue;
+            }
+        } else {
+            n = read(p->out_fd, buf.data(), min(len - moved, buf.size()));
+            if (n > 0) {
+                writeAll(out_fd, buf.data(), n);
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN) {
+            perror(use_splice ? "splice" : "read");
+            throw ShellException("Unable to forward output");
+        }
+        if (n <= 0) {
+            break;
         }
+        moved += n;
     }
+    return moved;
+}
 
-    int event_size = sizeof(struct inotify_event);
-    int event_buf_len = 1024 * (event_size + 16);
-    char event_buf[event_buf_len] __attribute__((aligned(__alignof__(struct inotify_event))));
+// Reports how long the run of p that just ended took
+void writeRunTime(int out_fd, Pipeline* p, double secs) {
+    char took[64];
+    int n = snprintf(took, sizeof(took), "\", took %.3f s\n", secs);
+    struct iovec iov[] = {{(void*)"\"", 1}, {(void*)p->cmd.data(), p->cmd.length()}, {took, (size_t)n}};
+    writevAll(out_fd, iov, sizeof(iov) / sizeof(iov[0]));
+}
 
-    char buf[1024];
+double monotonicTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    // Continue watching the file descriptors until all processes are done
-    while (num_running) {
-        int num_read = read(inotify_fd, event_buf, sizeof(event_buf));  // Get the next event
-        if (num_read < 0 && errno != EINTR && errno != EBADF) {
-            perror("read");
-            throw ShellException("Unable to read from inotify instance");
-        } else if (errno == EBADF) {  // When inotify instance has been closed
-            break;
+// Resizes watch_pgids to n runs that have not started, with SIGINT blocked so that multiWatch_SIGINT never walks it
+// while it is reallocated
+void resetWatchPgids(size_t n) {
+    blockSIGINT();
+    watch_pgids.assign(n, 0);
+    unblockSIGINT();
+}
+
+void startRun(int epoll_fd, WatchedCommand& w, int i) {
+    w.p->executePipeline(true);
+    w.started = monotonicTime();
+    watch_pgids[i] = w.p->pgid;
+    watchFd(epoll_fd, w.p->out_fd, (uint64_t)i << 1);
+    // Without pidfd support (before Linux 5.3), EOF on the pipe alone tells that the pipeline is done
+    w.pidfd = syscall(SYS_pidfd_open, w.p->cmds.back()->pid, 0);
+    if (w.pidfd >= 0) {
+        watchFd(epoll_fd, w.pidfd, ((uint64_t)i << 1) | 1);
+    }
+}
+
+// Executes the multiWatch command, multiplexing the output pipes of all pipelines with epoll. With an interval, a
+// timerfd in the same epoll instance queues a new run of every command that is not still running or waiting at each
+// tick, until Ctrl-C
+void executeMultiWatch(vector<Pipeline*>& pList, string output_file, double interval) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        throw ShellException("Unable to create epoll instance");
+    }
+    int out_fd = STDOUT_FILENO, timer_fd = -1;  // Closed on the way out, also when something below throws
+    vector<WatchedCommand> watched;
+
+    try {
+        if (output_file != "") {
+            // Open output file for writing (if anything other than stdout)
+            out_fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out_fd < 0) {
+                perror("open");
+                throw ShellException("Unable to open output file");
+            }
+        }
+        fflush(stdout);  // The output below bypasses stdio
+
+        if (interval > 0) {
+            timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+            if (timer_fd < 0) {
+                perror("timerfd_create");
+                throw ShellException("Unable to create timer");
+            }
+            struct itimerspec its;
+            its.it_interval.tv_sec = (time_t)interval;
+            its.it_interval.tv_nsec = (long)((interval - its.it_interval.tv_sec) * 1e9);
+            its.it_value = its.it_interval;
+            if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+                perror("timerfd_settime");
+                throw ShellException("Unable to set timer");
+            }
+            watchFd(epoll_fd, timer_fd, TIMER_TAG);
         }
 
-        int i = 0;
-        while (i < num_read) {
-            struct inotify_event* event = (struct inotify_event*)&event_buf[i];
-            // IN_MODIFY implies something has been written to the file
-            // IN_IGNORED implies the watch desriptor was removed from the watch list
-            if ((event->mask & IN_MODIFY) || (event->mask & IN_IGNORED)) {
-                int fd = fds[wd_ind[event->wd]];
-                int len, seen_data = 0;
-                while ((len = read(fd, buf, sizeof(buf))) > 0 || errno == EINTR) {
+        // Only the runs of multiWatch -n are bounded, otherwise all pipelines start at once as before
+        int max_running = (interval > 0) ? MAX_WATCH_RUNS : pList.size();
+        int num_running = 0;
+        watched.resize(pList.size());
+        deque<int> waiting;
+        for (int i = 0; i < (int)pList.size(); i++) {
+            watched[i] = {pList[i], -1, true, 0};
+            waiting.push_back(i);
+        }
+        resetWatchPgids(pList.size());  // Not resized below until multiWatch returns
+        watch_interrupted = 0;
+
+        struct epoll_event events[MAX_EVENTS];
+        vector<char> buf(READ_CHUNK);
+        bool use_splice = true;
+
+        while (true) {
+            if (watch_interrupted) {  // Let the interrupted runs finish, but start no more
+                if (timer_fd >= 0) {
+                    close(timer_fd);
+                    timer_fd = -1;
+                }
+                waiting.clear();
+            }
+            while (!waiting.empty() && num_running < max_running) {
+                int i = waiting.front();
+                waiting.pop_front();
+                watched[i].waiting = false;
+                startRun(epoll_fd, watched[i], i);
+                num_running++;
+            }
+            if (num_running == 0 && timer_fd < 0) {
+                break;
+            }
+
+            int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+            if (num_events < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("epoll_wait");
+                throw ShellException("Unable to wait on epoll instance");
+            }
+
+            for (int e = 0; e < num_events; e++) {
+                if (events[e].data.u64 == TIMER_TAG) {
+                    uint64_t ticks;
+                    if (read(timer_fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN && errno != EINTR) {
+                        perror("read");
+                        throw ShellException("Unable to read timer");
+                    }
+                    // Ticks missed while the shell was busy are not made up for
+                    for (int i = 0; i < (int)watched.size(); i++) {
+                        if (watched[i].p->out_fd < 0 && !watched[i].waiting) {
+                            watched[i].waiting = true;
+                            waiting.push_back(i);
+                        }
+                    }
+                    continue;
+                }
+                int i = events[e].data.u64 >> 1;
+                bool exited = events[e].data.u64 & 1;
+                Pipeline* p = watched[i].p;
+                if (p->out_fd < 0) {  // Already done, both its fds were ready in the same round
+                    continue;
+                }
+                // Forward what is in the pipe now, FIONREAD tells how much so that the header goes out before it
+                int avail, seen_data = 0;
+                while (ioctl(p->out_fd, FIONREAD, &avail) == 0 && avail > 0) {
                     if (!seen_data) {
-                        int sz = pList[wd_ind[event->wd]]->cmd.length() + to_string(time(NULL)).length() + 6;
-                        string line(sz, '-');
-                        fprintf(out_fp, "%s\n\"%s\", %ld :\n%s\n", line.c_str(), pList[wd_ind[event->wd]]->cmd.c_str(), time(NULL), line.c_str());
-                        fflush(out_fp);
+                        writeHeader(out_fd, p);
                         seen_data = 1;
                     }
-                    buf[len] = '\0';
-                    fprintf(out_fp, "%s", buf);  // Write to output file
-                    fflush(out_fp);
+                    if (forwardOutput(p, out_fd, avail, buf, use_splice) == 0) {
+                        break;
+                    }
+                }
+                // EOF, or the last command exited and what it wrote has been drained even if others still hold the pipe
+                if ((events[e].events & (EPOLLHUP | EPOLLERR)) || exited) {
+                    close(p->out_fd);  // Also removes it from the epoll instance
+                    p->out_fd = -1;
+                    if (watched[i].pidfd >= 0) {
+                        close(watched[i].pidfd);
+                        watched[i].pidfd = -1;
+                    }
+                    watch_pgids[i] = 0;
+                    job_table.remove(p->job_id);  // Nothing to report, and it may run again
+                    num_running--;
+                    if (interval > 0) {
+                        writeRunTime(out_fd, p, monotonicTime() - watched[i].started);
+                    }
                 }
             }
-            if (event->mask & IN_IGNORED) {
-                // The watch descriptor is removed in the signal handler when the process is finished and IN_IGNORED is set
-                num_running--;
-                close(fds[wd_ind[event->wd]]);
+        }
+    } catch (ShellException& e) {
+        // Nothing is left open or in the job table. Runs still going are interrupted, as by Ctrl-C
+        for (int i = 0; i < (int)watched.size(); i++) {
+            Pipeline* p = watched[i].p;
+            if (p->out_fd >= 0) {
+                close(p->out_fd);
+                p->out_fd = -1;
+            }
+            if (watched[i].pidfd >= 0) {
+                close(watched[i].pidfd);
+            }
+            if (watch_pgids[i] > 0) {
+                kill(-watch_pgids[i], SIGINT);
             }
-            i += event_size + event->len;
+            job_table.remove(p->job_id);
         }
-    }
-
-    // Delete the tmp files
-    for (auto it = pgid_wd.begin(); it != pgid_wd.end(); it++) {
-        string tmpFile = ".tmp." + to_string(it->first) + ".txt";
-        if (remove(tmpFile.c_str()) < 0) {
-            perror("remove");
-            throw ShellException("Unable to remove tmp file");
+        resetWatchPgids(0);
+        if (timer_fd >= 0) {
+            close(timer_fd);
         }
+        close(epoll_fd);
+        if (out_fd != STDOUT_FILENO) {
+            close(out_fd);
+        }
+        throw;
     }
-    pgid_wd.clear();
-    close(inotify_fd);
-    if (out_fp != stdout) {
-        fclose(out_fp);
+    resetWatchPgids(0);
+    close(epoll_fd);
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
     }
-}
\ No newline at end of file
+}
@@ -1,7 +1,8 @@
 #ifndef __MULTIWATCH_H
 #define __MULTIWATCH_H
 
-#include <map>
+#include <signal.h>
+
 #include <string>
 #include <vector>
 
@@ -9,11 +10,10 @@
 
 using namespace std;
 
-extern int inotify_fd;
-extern map<pid_t, int> pgid_wd;
-extern map<int, int> wd_ind;
+extern vector<pid_t> watch_pgids;
+extern volatile sig_atomic_t watch_interrupted;
 
-vector<Pipeline*> parseMultiWatch(string cmd, string& output_file);
-void executeMultiWatch(vector<Pipeline*>& pList, string output_file = "");
+vector<Pipeline*> parseMultiWatch(string cmd, string& output_file, double& interval);
+void executeMultiWatch(vector<Pipeline*>& pList, string output_file = "", double interval = 0);
 
 #endif
\ No newline at end of file
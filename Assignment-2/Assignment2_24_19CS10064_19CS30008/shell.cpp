@@ -7,12 +7,12 @@
 #include <unistd.h>
 
 #include <deque>
-#include <map>
 
 #include "Command.h"
 #include "Pipeline.h"
 #include "ShellException.h"
 #include "history.h"
+#include "job_table.h"
 #include "multiWatch.h"
 #include "read_command.h"
 #include "signal_handlers.h"
@@ -23,9 +23,6 @@ using namespace std;
 bool ctrlC = 0, ctrlZ = 0, ctrlD = 0;  // Indicates whether the user has pressed Ctrl-C, Ctrl-Z, or Ctrl-D
 pid_t fgpid = 0;                       // Foreground process group id
 
-vector<Pipeline*> all_pipelines;  // To store all the pipelines in the shell
-map<pid_t, int> ind;              // Mapping process id to index in the vector
-
 // To handle the cd builitin
 void shellCd(string arg) {
     trim(arg);
@@ -43,11 +40,16 @@ void shellExit(string arg) {
     exit(0);
 }
 
-// To handle the jobs bulitin - lists all the jobs
+// To handle the jobs bulitin - lists all the jobs, the ones that are done are removed after being listed
 void shellJobs(string arg) {
-    for (int i = 0; i < (int)all_pipelines.size(); i++) {
-        cout << "pgid: " << all_pipelines[i]->pgid << ": ";
-        int status = all_pipelines[i]->status;
+    blockSIGCHLD();  // So that no job finishes between being listed and being reclaimed
+    for (int id = 1; id <= job_table.maxId(); id++) {
+        Pipeline* p = job_table.get(id);
+        if (p == NULL) {
+            continue;
+        }
+        cout << "[" << id << "] pgid: " << p->pgid << ": ";
+        int status = p->status;
         if (status == RUNNING) {
             cout << "Running";
         } else if (status == STOPPED) {
@@ -57,11 +59,13 @@ void shellJobs(string arg) {
         }
         cout << endl;
 
-        vector<Command*> cmds = all_pipelines[i]->cmds;
+        vector<Command*>& cmds = p->cmds;
         for (int j = 0; j < (int)cmds.size(); j++) {
             cout << "--- pid: " << cmds[j]->pid << " " << cmds[j]->cmd << endl;
         }
     }
+    job_table.reclaimDone();
+    unblockSIGCHLD();
 }
 
 vector<string> builtins = {"cd", "exit", "jobs"};
@@ -112,7 +116,8 @@ int main() {
 
         try {
             string output_file = "";
-            vector<Pipeline*> pList = parseMultiWatch(cmd, output_file);  // Try parsing for multiWatch
+            double interval = 0;
+            vector<Pipeline*> pList = parseMultiWatch(cmd, output_file, interval);  // Try parsing for multiWatch
             if (pList.size() > 0) {                                       // multiWatch detected
                 // Change signal handlers in case of multiWatch
                 struct sigaction multiWatch_action;
@@ -122,7 +127,21 @@ int main() {
                 sigaction(SIGINT, &multiWatch_action, NULL);
                 signal(SIGTSTP, SIG_IGN);
                 
-                executeMultiWatch(pList, output_file);
+                try {
+                    executeMultiWatch(pList, output_file, interval);
+                } catch (ShellException& e) {
+                    for (Pipeline* p : pList) {
+                        job_table.remove(p->job_id);
+                        delete p;
+                    }
+                    sigaction(SIGINT, &action, NULL);
+                    sigaction(SIGTSTP, &action, NULL);
+                    throw;
+                }
+                for (Pipeline* p : pList) {
+                    job_table.remove(p->job_id);  // A no-op for the jobs multiWatch has already removed
+                    delete p;
+                }
 
                 // Revert back to signal handlers for the shell
                 sigaction(SIGINT, &action, NULL);
@@ -132,13 +151,24 @@ int main() {
                     throw ShellException("Error while parsing command");
                 }
                 Pipeline* p = new Pipeline(cmd);
-                p->parse();
-                string arg = p->cmds[0]->args[0];
-                if (arg == "cd" || arg == "exit" || arg == "jobs") {
-                    handleBuiltin(*p);
-                    continue;
+                try {
+                    p->parse();
+                    string arg = p->cmds[0]->args[0];
+                    if (arg == "cd" || arg == "exit" || arg == "jobs") {
+                        handleBuiltin(*p);
+                    } else {
+                        p->executePipeline();  // Execute the pipeline
+                    }
+                } catch (ShellException& e) {
+                    job_table.remove(p->job_id);
+                    delete p;
+                    throw;
+                }
+                // Jobs in the background or stopped stay in the job table until jobs reports them done
+                if (p->job_id == 0 || (!p->is_bg && p->status == DONE)) {
+                    job_table.remove(p->job_id);
+                    delete p;
                 }
-                p->executePipeline();   // Execute the pipeline
             }
         } catch (ShellException& e) {
             cout << e.what() << endl;
@@ -1,11 +1,10 @@
 #include "signal_handlers.h"
 
-#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include <map>
+#include "job_table.h"
 
 using namespace std;
 
@@ -19,15 +18,14 @@ void reapProcesses(int signum) {
             break;
         }
 
-        int id = ind[pid];
-        Pipeline* pipeline = all_pipelines[id];
+        Pipeline* pipeline = job_table.find(pid);
+        if (pipeline == NULL) {  // Its job was already removed, like a finished run of multiWatch
+            continue;
+        }
         if (WIFSIGNALED(status) || WIFEXITED(status)) {  // Terminated due to interrupt or normal exit
             pipeline->num_active--;
             if (pipeline->num_active == 0) {
                 pipeline->status = DONE;
-                if (pgid_wd.find(pipeline->pgid) != pgid_wd.end()) {  // Remove from watch list
-                    inotify_rm_watch(inotify_fd, pgid_wd[pipeline->pgid]);
-                }
             }
         } else if (WIFSTOPPED(status)) {    // Process was stopped (SIGTSTP)
             pipeline->num_active--;
@@ -49,20 +47,28 @@ void reapProcesses(int signum) {
     }
 }
 
-// These functions help in avoiding race conditions when SIGCHILD can be sent
-void toggleSIGCHLDBlock(int how) {
+// These functions help in avoiding race conditions when SIGCHILD or SIGINT can be sent
+void toggleSignalBlock(int signum, int how) {
     sigset_t mask;
     sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, signum);
     sigprocmask(how, &mask, NULL);
 }
 
 void blockSIGCHLD() {
-    toggleSIGCHLDBlock(SIG_BLOCK);
+    toggleSignalBlock(SIGCHLD, SIG_BLOCK);
 }
 
 void unblockSIGCHLD() {
-    toggleSIGCHLDBlock(SIG_UNBLOCK);
+    toggleSignalBlock(SIGCHLD, SIG_UNBLOCK);
+}
+
+void blockSIGINT() {
+    toggleSignalBlock(SIGINT, SIG_BLOCK);
+}
+
+void unblockSIGINT() {
+    toggleSignalBlock(SIGINT, SIG_UNBLOCK);
 }
 
 // Ensures no race conditions for foreground processes
@@ -86,10 +92,13 @@ void CZ_handler(int signum) {
     }
 }
 
-// Signal handler for multiWatch in case of SIGINT
+// Signal handler for multiWatch in case of SIGINT, multiWatch returns once the pipes of the interrupted pipelines close.
+// watch_pgids is only resized with SIGINT blocked, so it can be walked here
 void multiWatch_SIGINT(int signum) {
-    for (auto it = pgid_wd.begin(); it != pgid_wd.end(); it++) {
-        kill(-it->first, SIGINT);
+    watch_interrupted = 1;
+    for (pid_t pgid : watch_pgids) {
+        if (pgid > 0) {
+            kill(-pgid, SIGINT);
+        }
     }
-    close(inotify_fd);
 }
\ No newline at end of file
@@ -1,10 +1,10 @@
 #ifndef __SIGNAL_HANDLERS_H
 #define __SIGNAL_HANDLERS_H
 
+#include <signal.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <map>
 #include <vector>
 
 #include "Pipeline.h"
@@ -14,16 +14,15 @@ using namespace std;
 extern bool ctrlC, ctrlZ, ctrlD;
 extern pid_t fgpid;
 
-extern vector<Pipeline*> all_pipelines;
-extern map<pid_t, int> ind;
-
-extern int inotify_fd;
-extern map<pid_t, int> pgid_wd;
+extern vector<pid_t> watch_pgids;
+extern volatile sig_atomic_t watch_interrupted;
 
 void reapProcesses(int signum);
-void toggleSIGCHLDBlock(int how);
+void toggleSignalBlock(int signum, int how);
 void blockSIGCHLD();
 void unblockSIGCHLD();
+void blockSIGINT();
+void unblockSIGINT();
 void waitForForegroundProcess(pid_t pid);
 void CZ_handler(int signum);
 void multiWatch_SIGINT(int signum);
@@ -0,0 +1,90 @@
+/*
+    Mixed hot/cold workload for the compaction modes. Small hot arrays are allocated
+    between large cold ones, so after a sliding compaction every hot array still sits
+    on its own cache line and page; COMPACT_HOT_FIRST packs them together at the start
+    of the heap. After warming up the access counters and compacting, the hot arrays
+    are read at random with the occasional cold read, and the time per read is reported.
+
+    Usage: bench_hotcold [slide|hot]   (both, each in a child process, if not given)
+    Run under perf stat to see the cache and TLB misses, e.g. make perf-hotcold
+*/
+
+#include <sys/wait.h>
+
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include "memlab.h"
+
+using namespace std;
+
+const int NUM_SHARDS = 8;
+const int NUM_OBJECTS = 7800;
+const int HOT_EVERY = 10;  // one in every HOT_EVERY objects is hot
+const int HOT_LEN = 4;
+const int COLD_LEN = 1000;
+const int COLD_READ_EVERY = 20;
+const int WARMUP_READS = 200;  // per hot array
+const int NUM_READS = 5000000;
+
+void run(CompactionMode mode, const char *name) {
+    createMem((size_t)NUM_OBJECTS * COLD_LEN * 4, false, false, "", FIRST_FIT, NUM_SHARDS);
+    setCompactionMode(mode);
+    vector<MyType *> hot, cold;
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        if (i % HOT_EVERY == 0) {
+            hot.push_back(new MyType(createArr(INT, HOT_LEN)));
+        } else {
+            cold.push_back(new MyType(createArr(INT, COLD_LEN)));
+        }
+    }
+    vector<MyType *> kept;
+    for (size_t i = 0; i < cold.size(); i++) {  // leave holes for the compaction to close
+        if (i % 4 == 0) {
+            freeElem(*cold[i]);
+        } else {
+            kept.push_back(cold[i]);
+        }
+    }
+    int val;
+    for (MyType *h : hot) {
+        for (int r = 0; r < WARMUP_READS; r++) {
+            readArr(*h, r % HOT_LEN, &val);
+        }
+    }
+    compactNow();
+
+    unsigned int seed = 42;
+    long sum = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (int r = 0; r < NUM_READS; r++) {
+        seed = seed * 1103515245 + 12345;
+        if (r % COLD_READ_EVERY == 0) {
+            readArr(*kept[seed % kept.size()], seed % COLD_LEN, &val);
+        } else {
+            readArr(*hot[seed % hot.size()], seed % HOT_LEN, &val);
+        }
+        sum += val;
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    printf("%-6s %10.1f ns/read %12zu bytes moved (sum %ld)\n", name, secs * 1e9 / NUM_READS, getMemStats().bytes_moved, sum);
+    cleanExit();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        run(strcmp(argv[1], "hot") == 0 ? COMPACT_HOT_FIRST : COMPACT_SLIDE, argv[1]);
+    }
+    CompactionMode modes[] = {COMPACT_SLIDE, COMPACT_HOT_FIRST};
+    const char *names[] = {"slide", "hot"};
+    for (int i = 0; i < 2; i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(modes[i], names[i]);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+    Compares the placement policies on the demo workloads. Each policy runs in a
+    separate child process since the memory can only be created once per process.
+    For every workload it reports the throughput of createVar/createArr/freeElem,
+    the average and maximum fragmentation (1 - largest free block / total free) and
+    the number of compactions that had to be done.
+*/
+
+#include <sys/wait.h>
+
+#include <chrono>
+#include <vector>
+
+#include "memlab.h"
+
+using namespace std;
+
+const int MIXED_OPS = 200000;
+const int MIXED_MAX_LIVE = 800;
+const size_t MIXED_HEAP = 1024 * 1024;
+const int SAMPLE_EVERY = 1000;
+
+struct Result {
+    size_t ops;
+    double secs;
+    double frag_sum;
+    double frag_max;
+    int samples;
+};
+
+double fragmentation() {
+    MemStats s = getMemStats();
+    if (s.bytes_free == 0) {
+        return 0;
+    }
+    return 1.0 - (double)s.largest_free_block / (double)s.bytes_free;
+}
+
+void sample(Result &r) {
+    double f = fragmentation();
+    r.frag_sum += f;
+    r.frag_max = max(r.frag_max, f);
+    r.samples++;
+}
+
+// demo1: scoped 50000 element arrays of every type, freed when the scope ends
+void scopedArrays(Result &r) {
+    DataType types[] = {INT, MEDIUM_INT, CHAR, BOOLEAN};
+    for (int round = 0; round < 200; round++) {
+        auto t0 = chrono::steady_clock::now();
+        MyType arr = createArr(types[round % 4], 50000);
+        MyType v = createVar(types[round % 4]);
+        freeElem(arr);
+        r.secs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        r.ops += 3;
+        sample(r);
+        freeElem(v);
+    }
+}
+
+// demo2/demo3: interleaved variables and small arrays with every other one freed
+void interleaved(Result &r) {
+    for (int round = 0; round < 50; round++) {
+        auto t0 = chrono::steady_clock::now();
+        vector<MyType> objs;
+        for (int i = 0; i < 15; i++) {
+            if (i % 3 == 0) {
+                objs.push_back(createVar((DataType)(i % 4)));
+            } else {
+                objs.push_back(createArr((DataType)(i % 4), 8 + 4 * i));
+            }
+        }
+        for (size_t i = 0; i < objs.size(); i += 2) {
+            freeElem(objs[i]);
+        }
+        objs.push_back(createArr(INT, 40));
+        r.secs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        r.ops += 24;
+        sample(r);
+        for (size_t i = 1; i < objs.size(); i += 2) {  // the odd ones left, including the last array
+            freeElem(objs[i]);
+        }
+    }
+}
+
+// Mixed: random mix of variables, small and large arrays with random lifetimes
+void mixed(Result &r) {
+    vector<MyType *> live;  // MyType is not assignable, so keep pointers for removal from the middle
+    vector<size_t> live_words;
+    size_t total_words = 0;
+    const size_t budget = MIXED_HEAP / 4 / 2;  // keep at most half the heap live
+    auto t0 = chrono::steady_clock::now();
+    for (int op = 0; op < MIXED_OPS; op++) {
+        bool create = live.empty() || ((int)live.size() < MIXED_MAX_LIVE && rand() % 2 == 0);
+        if (create) {
+            int kind = rand() % 10;
+            size_t words = 1;
+            if (kind < 4) {
+                live.push_back(new MyType(createVar((DataType)(rand() % 4))));
+            } else {
+                int len = (kind < 8) ? 1 + rand() % 16 : 100 + rand() % 4000;
+                words = len;
+                if (total_words + words > budget) {
+                    continue;
+                }
+                live.push_back(new MyType(createArr(INT, len)));
+            }
+            live_words.push_back(words);
+            total_words += words;
+        } else {
+            size_t i = rand() % live.size();
+            freeElem(*live[i]);
+            delete live[i];
+            total_words -= live_words[i];
+            live[i] = live.back();
+            live.pop_back();
+            live_words[i] = live_words.back();
+            live_words.pop_back();
+        }
+        r.ops++;
+        if (op % SAMPLE_EVERY == 0) {
+            r.secs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            sample(r);
+            t0 = chrono::steady_clock::now();
+        }
+    }
+    r.secs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    for (MyType *v : live) {
+        freeElem(*v);
+        delete v;
+    }
+}
+
+void runPolicy(PlacementPolicy policy, const char *name) {
+    createMem(MIXED_HEAP, false, false, "", policy);
+    srand(42);
+    const char *workloads[] = {"scoped", "interleaved", "mixed"};
+    void (*funcs[])(Result &) = {scopedArrays, interleaved, mixed};
+    for (int w = 0; w < 3; w++) {
+        Result r = {0, 0, 0, 0, 0};
+        size_t compactions = getMemStats().compactions;
+        funcs[w](r);
+        printf("%-10s %-12s %12.0f %10.3f %10.3f %12zu\n", name, workloads[w], r.ops / r.secs, r.frag_sum / r.samples, r.frag_max,
+               getMemStats().compactions - compactions);
+    }
+    cleanExit();
+}
+
+int main() {
+    printf("%-10s %-12s %12s %10s %10s %12s\n", "policy", "workload", "ops/s", "avg frag", "max frag", "compactions");
+    PlacementPolicy policies[] = {FIRST_FIT, NEXT_FIT, BEST_FIT};
+    const char *names[] = {"first-fit", "next-fit", "best-fit"};
+    for (int i = 0; i < 3; i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            runPolicy(policies[i], names[i]);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
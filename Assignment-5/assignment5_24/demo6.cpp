@@ -0,0 +1,49 @@
+/*
+    Demonstrates sharing the memory between processes. The parent and child both call
+    createSharedMem with the same name; the parent creates and fills an array, sends
+    its handle to the child through a pipe, and the child reads it without any copying.
+*/
+
+#include <sys/wait.h>
+
+#include "memlab.h"
+
+using namespace std;
+
+const int ARR_SIZE = 10;
+const char SHM_NAME[] = "/memlab_demo6";
+
+int main() {
+    int fd[2];
+    pipe(fd);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fd[1]);
+        int ind;
+        read(fd[0], &ind, sizeof(ind));
+        createSharedMem(SHM_NAME, 400);
+        initScope();
+        MyType arr(ind, ARRAY, INT, ARR_SIZE);
+        int vals[ARR_SIZE];
+        readArr(arr, vals);
+        printf("Child read the array created by the parent:");
+        for (int i = 0; i < ARR_SIZE; i++) {
+            printf(" %d", vals[i]);
+        }
+        printf("\n");
+        endScope();
+        cleanExit();
+    }
+
+    close(fd[0]);
+    createSharedMem(SHM_NAME, 400);
+    initScope();
+    MyType arr = createArr(INT, ARR_SIZE);
+    for (int i = 0; i < ARR_SIZE; i++) {
+        assignArr(arr, i, i * i);
+    }
+    write(fd[1], &arr.ind, sizeof(arr.ind));
+    waitpid(pid, NULL, 0);  // The array must stay in scope till the child is done with it
+    endScope();
+    cleanExit();
+}
@@ -0,0 +1,56 @@
+/*
+    Demonstrates scopes in multiple threads. Each thread has its own scope stack, so
+    the threads create, populate and drop arrays in nested scopes concurrently while
+    the garbage collector frees whatever has gone out of scope in any of them. The
+    memory is split into one shard per thread, so the threads mostly allocate under
+    different locks.
+*/
+
+#include <pthread.h>
+
+#include "memlab.h"
+
+using namespace std;
+
+const int NUM_THREADS = 4;
+const int NUM_ROUNDS = 50;
+const int ARR_SIZE = 1000;
+
+void *worker(void *arg) {
+    long id = (long)arg;
+    initScope();
+    MyType sum = createVar(INT);
+    assignVar(sum, 0);
+    for (int round = 0; round < NUM_ROUNDS; round++) {
+        initScope();
+        MyType arr = createArr(INT, ARR_SIZE);
+        for (int i = 0; i < ARR_SIZE; i++) {
+            assignArr(arr, i, (int)id);
+        }
+        int val, s;
+        readArr(arr, ARR_SIZE - 1, &val);
+        readVar(sum, &s);
+        assignVar(sum, s + val);
+        endScope();
+        gcActivate();
+    }
+    int s;
+    readVar(sum, &s);
+    printf("Thread %ld: sum = %d (expected %d)\n", id, s, (int)id * NUM_ROUNDS);
+    endScope();
+    return NULL;
+}
+
+int main() {
+    // enough even if the garbage collector falls behind
+    createMem(NUM_THREADS * NUM_ROUNDS * ARR_SIZE * 4, true, false, "", FIRST_FIT, NUM_THREADS);
+    pthread_t tids[NUM_THREADS];
+    for (long i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&tids[i], NULL, worker, (void *)i);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    gcActivate();
+    cleanExit();
+}
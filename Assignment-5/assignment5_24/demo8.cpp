@@ -0,0 +1,164 @@
+/*
+    Demonstrates the concurrent compactor next to threads that clone, write and free
+    arrays. Churning threads keep a window of arrays of different sizes and free one
+    at random each round, so the heap stays fragmented and the compactor keeps moving
+    objects down. Cloning threads keep replacing arrays that start out at the top of
+    the heap by clones of them, so clones are taken while the compactor is copying
+    the original. Every array, and every clone after its original has moved, must
+    still hold the data written into it, and nothing may be left in use at the end.
+*/
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+#include "memlab.h"
+
+using namespace std;
+
+const int NUM_CHURNERS = 2;
+const int NUM_CLONERS = 2;
+const int NUM_ROUNDS = 20000;
+const int WINDOW = 16;
+const int MAX_LEN = 8192;
+const int NUM_HOT = 16;
+const int HOT_LEN = 2048;
+
+atomic<int> errors(0);
+atomic<bool> churning(true);
+
+struct Entry {
+    MyType *arr;  // handles cannot be assigned, so the window keeps pointers to them
+    int round;    // round the data was written in
+};
+
+Entry hot_arrays[NUM_CLONERS][NUM_HOT];
+
+int valueAt(long id, int round, int i) {
+    return (int)id * 1000000 + round * 16 + i % 16;
+}
+
+void check(MyType &arr, long id, int round, vector<int> &buf) {
+    readArr(arr, buf.data());
+    for (int i = 0; i < (int)arr.len; i++) {
+        if (buf[i] != valueAt(id, round, i)) {
+            errors++;
+            return;
+        }
+    }
+}
+
+void *churner(void *arg) {
+    long id = (long)arg;
+    unsigned int seed = id;
+    vector<int> vals(MAX_LEN), buf(MAX_LEN);
+    vector<Entry> window;
+    for (int round = 0; round < NUM_ROUNDS; round++) {
+        int len = 16 + rand_r(&seed) % (MAX_LEN - 16);
+        for (int i = 0; i < len; i++) {
+            vals[i] = valueAt(id, round, i);
+        }
+        MyType *arr = new MyType(createArr(INT, len));
+        assignArr(*arr, vals.data());
+        window.push_back({arr, round});
+
+        // replace one array by a clone of it
+        Entry &e = window[rand_r(&seed) % window.size()];
+        MyType *clone = new MyType(cloneArr(*e.arr));
+        if (round % 2 == 0) {
+            assignArr(*clone, 0, valueAt(id, e.round, 0));  // same value, but the clone gets its own copy
+        }
+        freeElem(*e.arr);
+        delete e.arr;
+        e.arr = clone;
+
+        if ((int)window.size() > WINDOW) {
+            int k = rand_r(&seed) % window.size();
+            check(*window[k].arr, id, window[k].round, buf);
+            freeElem(*window[k].arr);
+            delete window[k].arr;
+            window.erase(window.begin() + k);
+        }
+    }
+    for (Entry &e : window) {
+        check(*e.arr, id, e.round, buf);
+        freeElem(*e.arr);
+        delete e.arr;
+    }
+    return NULL;
+}
+
+// Replaces its arrays by clones of them as fast as it can, so that some are cloned while the compactor copies them.
+// The original is only freed NUM_HOT rounds after the clone was taken, by when the move may have been committed.
+void *cloner(void *arg) {
+    long id = (long)arg;
+    Entry *hot = hot_arrays[id];
+    vector<int> buf(HOT_LEN);
+    vector<MyType *> pending(NUM_HOT, NULL);  // clone of hot[k] waiting to replace it
+    for (int round = 0; churning.load(); round++) {
+        int k = round % NUM_HOT;
+        if (pending[k] == NULL) {
+            pending[k] = new MyType(cloneArr(*hot[k].arr));
+            continue;
+        }
+        check(*pending[k], NUM_CHURNERS + id, hot[k].round, buf);
+        freeElem(*hot[k].arr);
+        delete hot[k].arr;
+        hot[k].arr = pending[k];
+        pending[k] = NULL;
+    }
+    for (int k = 0; k < NUM_HOT; k++) {
+        check(*hot[k].arr, NUM_CHURNERS + id, hot[k].round, buf);
+        freeElem(*hot[k].arr);
+        delete hot[k].arr;
+        if (pending[k] != NULL) {
+            freeElem(*pending[k]);
+            delete pending[k];
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    size_t churn_words = NUM_CHURNERS * WINDOW * MAX_LEN * 2;
+    // next fit spreads the arrays over the heap, which keeps it fragmented
+    createMem((churn_words + NUM_CLONERS * NUM_HOT * HOT_LEN) * 4, false, false, "", NEXT_FIT);
+
+    // the arrays of the cloning threads go at the top, so the compactor gets to them as soon as there are holes
+    MyType filler = createArr(INT, churn_words - 64);
+    vector<int> vals(HOT_LEN);
+    for (long id = 0; id < NUM_CLONERS; id++) {
+        for (int k = 0; k < NUM_HOT; k++) {
+            for (int i = 0; i < HOT_LEN; i++) {
+                vals[i] = valueAt(NUM_CHURNERS + id, k, i);
+            }
+            hot_arrays[id][k] = {new MyType(createArr(INT, HOT_LEN)), k};
+            assignArr(*hot_arrays[id][k].arr, vals.data());
+        }
+    }
+    freeElem(filler);
+
+    compactorStart();
+    pthread_t churners[NUM_CHURNERS], cloners[NUM_CLONERS];
+    for (long i = 0; i < NUM_CHURNERS; i++) {
+        pthread_create(&churners[i], NULL, churner, (void *)i);
+    }
+    for (long i = 0; i < NUM_CLONERS; i++) {
+        pthread_create(&cloners[i], NULL, cloner, (void *)i);
+    }
+    for (int i = 0; i < NUM_CHURNERS; i++) {
+        pthread_join(churners[i], NULL);
+    }
+    churning.store(false);
+    for (int i = 0; i < NUM_CLONERS; i++) {
+        pthread_join(cloners[i], NULL);
+    }
+    compactorStop();
+    MemStats ms = getMemStats();
+    printf("Moves: %zu, aborted: %zu, copy-on-write copies: %zu\n", ms.moves, ms.moves_aborted, ms.cow_copies);
+    printf("Arrays with wrong data: %d, bytes still in use: %zu\n", errors.load(), ms.bytes_live);
+    cleanExit();
+    return (errors.load() == 0 && ms.bytes_live == 0) ? 0 : 1;
+}
@@ -1,47 +1,334 @@
 #include "memlab.h"
 
+#include "memlab_trace.h"
+
+#include <execinfo.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <signal.h>
-
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
 #include <cstring>
+#include <ctime>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
-#ifdef LOGS
-#define DEBUG(msg, ...) printf("\x1b[32m[DEBUG] " msg " \x1b[0m\n", ##__VA_ARGS__);
-#define ERROR(msg, ...) printf("\x1b[31m[ERROR] " msg " \x1b[0m\n", ##__VA_ARGS__);
-#define LIBRARY(msg, ...) printf("\x1b[34m[LIBRARY] " msg " \x1b[0m\n", ##__VA_ARGS__);
-#define PAGE_TABLE(msg, ...) printf("\x1b[37m[PAGE TABLE] " msg " \x1b[0m\n", ##__VA_ARGS__);
-#define WORD_ALIGN(msg, ...) printf("\x1b[36m[WORD ALIGNMENT] " msg " \x1b[0m\n", ##__VA_ARGS__);
-#define GC(msg, ...) printf("\x1b[33m[GC] " msg "\x1b[0m\n", ##__VA_ARGS__);
-#define STACK(msg, ...) printf("\x1b[37m[STACK] " msg "\x1b[0m\n", ##__VA_ARGS__);
-#define MEMORY(msg, ...) printf("\x1b[37m[MEMORY] " msg "\x1b[0m\n", ##__VA_ARGS__);
-#else
-#define DEBUG(msg, ...)
-#define ERROR(msg, ...)
-#define LIBRARY(msg, ...)
-#define PAGE_TABLE(msg, ...)
-#define WORD_ALIGN(msg, ...)
-#define GC(msg, ...)
-#define STACK(msg, ...)
-#define MEMORY(msg, ...)
-#endif
+// Logging. A disabled message costs one relaxed load and a branch. Enabled ones are formatted into a buffer of the
+// calling thread, which the log thread drains every LOG_FLUSH_US, so threads do not block on the terminal or file.
+// Lines from different threads may come out of order with respect to each other. The log thread is started with the
+// memory or by setLogLevel, never by a message, which may be logged from the SIGUSR1 handler; until then (and in a
+// forked child) messages are written out directly.
+atomic<int> log_level(LOG_OFF);
+
+#define LOG(level, prefix, msg, ...)                                            \
+    do {                                                                        \
+        if (__builtin_expect(log_level.load(memory_order_relaxed) >= level, 0)) \
+            logWrite(prefix msg "\x1b[0m\n", ##__VA_ARGS__);                    \
+    } while (0)
+
+#define DEBUG(msg, ...) LOG(LOG_TRACE, "\x1b[32m[DEBUG] ", msg, ##__VA_ARGS__)
+#define ERROR(msg, ...) LOG(LOG_ERROR, "\x1b[31m[ERROR] ", msg, ##__VA_ARGS__)
+#define LIBRARY(msg, ...) LOG(LOG_INFO, "\x1b[34m[LIBRARY] ", msg, ##__VA_ARGS__)
+#define PAGE_TABLE(msg, ...) LOG(LOG_TRACE, "\x1b[37m[PAGE TABLE] ", msg, ##__VA_ARGS__)
+#define WORD_ALIGN(msg, ...) LOG(LOG_TRACE, "\x1b[36m[WORD ALIGNMENT] ", msg, ##__VA_ARGS__)
+#define GC(msg, ...) LOG(LOG_DEBUG, "\x1b[33m[GC] ", msg, ##__VA_ARGS__)
+#define STACK(msg, ...) LOG(LOG_DEBUG, "\x1b[37m[STACK] ", msg, ##__VA_ARGS__)
+#define MEMORY(msg, ...) LOG(LOG_DEBUG, "\x1b[37m[MEMORY] ", msg, ##__VA_ARGS__)
+
+#define LOG_ENV "MEMLAB_LOG"
+#define LOG_FILE_ENV "MEMLAB_LOG_FILE"
+
+const size_t LOG_BUF_SIZE = 64 * 1024;
+const size_t LOG_LINE_MAX = 1024;
+const int LOG_FLUSH_US = 1000;
+
+struct LogBuffer {
+    char buf[LOG_BUF_SIZE];
+    size_t len;
+    pthread_mutex_t mutex;  // taken by the owning thread to append and by the log thread to drain
+    bool orphaned;          // the owning thread has exited, the buffer is freed once drained
+    LogBuffer *next;
+};
+
+thread_local LogBuffer *log_buf = NULL;
+LogBuffer *log_bufs = NULL;  // registry of all log buffers
+pthread_mutex_t log_bufs_mutex = PTHREAD_MUTEX_INITIALIZER;  // guards the head of log_bufs
+pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;  // one drain at a time, only a drain unlinks buffers
+pthread_key_t log_key;
+pthread_once_t log_once = PTHREAD_ONCE_INIT;
+atomic<bool> log_thread_running(false);
+int log_fd = STDOUT_FILENO;
+
+void logWriteAll(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Writes out and empties every buffer, freeing the ones whose thread has exited. out must hold LOG_BUF_SIZE bytes.
+// New buffers are only pushed at the head, so the list lock is needed just to unlink and never held while writing.
+void logDrain(char *out) {
+    pthread_mutex_lock(&log_drain_mutex);
+    pthread_mutex_lock(&log_bufs_mutex);
+    LogBuffer **pp = &log_bufs;
+    LogBuffer *b = log_bufs;
+    pthread_mutex_unlock(&log_bufs_mutex);
+    while (b != NULL) {
+        pthread_mutex_lock(&b->mutex);
+        size_t len = b->len;
+        memcpy(out, b->buf, len);
+        b->len = 0;
+        bool orphaned = b->orphaned;
+        pthread_mutex_unlock(&b->mutex);
+        logWriteAll(out, len);
+        LogBuffer *next = b->next;
+        if (orphaned) {
+            pthread_mutex_lock(&log_bufs_mutex);
+            while (*pp != b) {  // buffers pushed since
+                pp = &(*pp)->next;
+            }
+            *pp = next;
+            pthread_mutex_unlock(&log_bufs_mutex);
+            pthread_mutex_destroy(&b->mutex);
+            free(b);
+        } else {
+            pp = &b->next;
+        }
+        b = next;
+    }
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+void logFlush() {
+    char *out = (char *)malloc(LOG_BUF_SIZE);
+    logDrain(out);
+    free(out);
+}
+
+void *logThread(void *) {
+    char *out = (char *)malloc(LOG_BUF_SIZE);
+    while (1) {
+        usleep(LOG_FLUSH_US);
+        logDrain(out);
+    }
+    return NULL;
+}
+
+void releaseLogBuffer(void *b) {
+    pthread_mutex_lock(&((LogBuffer *)b)->mutex);
+    ((LogBuffer *)b)->orphaned = true;
+    pthread_mutex_unlock(&((LogBuffer *)b)->mutex);
+}
+
+// fork() keeps only the calling thread, so every buffer is locked across it. The child drops what the parent will
+// write out anyway and, having no log thread, writes its own messages out directly.
+void logPrepareFork() {
+    pthread_mutex_lock(&log_drain_mutex);
+    pthread_mutex_lock(&log_bufs_mutex);
+    for (LogBuffer *b = log_bufs; b != NULL; b = b->next) {
+        pthread_mutex_lock(&b->mutex);
+    }
+}
+
+void logParentFork() {
+    for (LogBuffer *b = log_bufs; b != NULL; b = b->next) {
+        pthread_mutex_unlock(&b->mutex);
+    }
+    pthread_mutex_unlock(&log_bufs_mutex);
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+void logChildFork() {
+    for (LogBuffer *b = log_bufs; b != NULL; b = b->next) {
+        b->len = 0;
+        pthread_mutex_unlock(&b->mutex);
+    }
+    pthread_mutex_unlock(&log_bufs_mutex);
+    pthread_mutex_unlock(&log_drain_mutex);
+    log_thread_running.store(false);
+}
+
+void logInitOnce() {
+    pthread_key_create(&log_key, releaseLogBuffer);
+    pthread_atfork(logPrepareFork, logParentFork, logChildFork);
+    atexit(logFlush);
+}
+
+void logStartThread() {
+    pthread_once(&log_once, logInitOnce);
+    if (!log_thread_running.exchange(true)) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, logThread, NULL);
+        pthread_detach(tid);
+    }
+}
+
+LogBuffer *getLogBuffer() {
+    if (log_buf == NULL) {
+        log_buf = (LogBuffer *)malloc(sizeof(LogBuffer));
+        log_buf->len = 0;
+        log_buf->orphaned = false;
+        pthread_mutex_init(&log_buf->mutex, NULL);
+        pthread_mutex_lock(&log_bufs_mutex);
+        log_buf->next = log_bufs;
+        log_bufs = log_buf;
+        pthread_mutex_unlock(&log_bufs_mutex);
+        pthread_setspecific(log_key, log_buf);
+    }
+    return log_buf;
+}
+
+void logWrite(const char *fmt, ...) {
+    char line[LOG_LINE_MAX];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, LOG_LINE_MAX, fmt, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len >= LOG_LINE_MAX) {  // truncated, keep the colour reset and line ending
+        const char end[] = "\x1b[0m\n";
+        len = LOG_LINE_MAX - 1;
+        memcpy(line + len - (sizeof(end) - 1), end, sizeof(end) - 1);
+    }
+    if (!log_thread_running.load(memory_order_relaxed)) {
+        logWriteAll(line, len);
+        return;
+    }
+    LogBuffer *b = getLogBuffer();
+    pthread_mutex_lock(&b->mutex);
+    if (b->len + len > LOG_BUF_SIZE) {  // the log thread is behind, write out here rather than drop lines
+        logWriteAll(b->buf, b->len);
+        b->len = 0;
+    }
+    memcpy(b->buf + b->len, line, len);
+    b->len += len;
+    pthread_mutex_unlock(&b->mutex);
+}
+
+void setLogLevel(LogLevel level) {
+    if (level > LOG_OFF) {
+        logStartThread();
+    }
+    log_level.store(level, memory_order_relaxed);
+}
+
+// Reads the log level and file from the environment, called when the memory is created
+void initLog() {
+    const char *file = getenv(LOG_FILE_ENV);
+    if (file != NULL && log_fd == STDOUT_FILENO) {
+        int fd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd != -1) {
+            log_fd = fd;
+        }
+    }
+    const char *env = getenv(LOG_ENV);
+    if (env == NULL) {
+        return;
+    }
+    const char *names[] = {"off", "error", "info", "debug", "trace"};
+    for (int i = LOG_OFF; i <= LOG_TRACE; i++) {
+        if (strcmp(env, names[i]) == 0) {
+            setLogLevel((LogLevel)i);
+        }
+    }
+}
 
 typedef unsigned int u_int;
 typedef long unsigned int u_long;
 
-const size_t MAX_PT_ENTRIES = 1024;
+const size_t MAX_PT_ENTRIES = 1024;  // must be 1 << IDX_BITS
 const size_t MAX_STACK_SIZE = 1024;
 
 const double EXTRA_MEM_FACTOR = 1.25;
 const int GC_SLEEP_US = 10;
 const double COMPACTION_RATIO_THRESHOLD = 3.0;
+const size_t LAZY_SWEEP_QUOTA = 2;  // queued garbage entries swept by every allocation
+const int ACCESS_SAMPLE_EVERY = 8;
+const size_t HEAT_DECAY_CYCLES = 1000;
+const size_t MIN_COMPRESS_WORDS = 16;  // smaller arrays are not worth compressing
+const int LZ_HASH_BITS = 12;
+const size_t MAX_SITES = 512;
+const u_int NO_SITE = MAX_SITES;  // allocation not sampled by the site profiler
+const int SHM_POLL_US = 100;
+const char SHM_MAGIC[] = "MEMLAB1";
 
 bool gc_active;
 bool profiler_active;
 FILE *fp;
 
+// Event counters for getMemStats, updated with relaxed atomics so that they never add to lock hold times
+struct Stats {
+    atomic<size_t> num_allocs[4];  // indexed by DataType
+    atomic<size_t> num_frees[4];
+    atomic<size_t> gc_cycles;
+    atomic<size_t> objects_swept;
+    atomic<size_t> compactions;
+    atomic<size_t> bytes_moved;
+    atomic<size_t> cow_copies;
+    atomic<size_t> moves;
+    atomic<size_t> moves_aborted;
+    atomic<size_t> compressed_arrays;
+    atomic<size_t> compression_bytes_saved;
+    atomic<size_t> decompressions;
+    atomic<size_t> spilled_arrays;
+    atomic<size_t> spill_bytes;
+    atomic<size_t> spill_faults;
+    atomic<size_t> gc_pause_total_ns;
+    atomic<size_t> gc_pause_max_ns;
+};
+
+Stats stats;
+
+inline void statAdd(atomic<size_t> &counter, size_t val) {
+    counter.fetch_add(val, memory_order_relaxed);
+}
+
+inline void statMax(atomic<size_t> &counter, size_t val) {
+    size_t curr = counter.load(memory_order_relaxed);
+    while (curr < val && !counter.compare_exchange_weak(curr, val, memory_order_relaxed)) {
+    }
+}
+
+inline size_t statGet(const atomic<size_t> &counter) {
+    return counter.load(memory_order_relaxed);
+}
+
+size_t getTimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (size_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Monotonic time in milliseconds, wrapping every 49 days, so differences are only meaningful below that
+inline u_int nowMs() {
+    return (u_int)(getTimeNs() / 1000000);
+}
+
 void LOCK(pthread_mutex_t *mutex) {
     int status = pthread_mutex_lock(mutex);
     if (status != 0) {
@@ -58,6 +345,18 @@ void UNLOCK(pthread_mutex_t *mutex) {
     }
 }
 
+// Initializes an error checking mutex, usable across processes if it lives in shared memory
+void initMutex(pthread_mutex_t *mutex, bool shared) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK_NP);
+    if (shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
 // Reference: https://web2.qatar.cmu.edu/~msakr/15213-f09/lectures/class19.pdf
 struct Memory {
     int *start;
@@ -66,11 +365,20 @@ struct Memory {
     size_t totalFree;
     u_int numFreeBlocks;
     size_t currMaxFree;
+    size_t peakUsed;  // highest number of allocated words so far
     pthread_mutex_t mutex;
-
-    int init(size_t bytes) {
+    PlacementPolicy policy;
+    int *rover;                            // where the next fit search resumes from
+    set<pair<u_int, u_int>> *free_index;  // (size, offset) of every free block, only kept for best fit
+    u_int move_idx;                        // entry the concurrent compactor is copying, MAX_PT_ENTRIES if none
+    u_int move_dst;                        // offset of the block it is being copied to
+    atomic<bool> copying;                  // set while the copy runs, without the lock
+    atomic<bool> move_cancel;              // set by compaction to stop the copy after the chunk in progress
+
+    // Uses heap as the memory if given (shared memory), otherwise allocates it
+    int init(size_t bytes, PlacementPolicy _policy, int *heap = NULL) {
         bytes = ((bytes + 3) >> 2) << 2;
-        start = (int *)malloc(bytes);
+        start = (heap != NULL) ? heap : (int *)malloc(bytes);
         if (start == NULL) {
             return -1;
         }
@@ -82,11 +390,17 @@ struct Memory {
         totalFree = bytes >> 2;
         numFreeBlocks = 1;
         currMaxFree = bytes >> 2;
+        peakUsed = 0;
+
+        policy = _policy;
+        rover = start;
+        free_index = (policy == BEST_FIT) ? new set<pair<u_int, u_int>>() : NULL;
+        indexInsert(start);
+        move_idx = MAX_PT_ENTRIES;
+        copying.store(false, memory_order_relaxed);
+        move_cancel.store(false, memory_order_relaxed);
 
-        pthread_mutexattr_t attr;
-        pthread_mutexattr_init(&attr);
-        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK_NP);
-        pthread_mutex_init(&mutex, &attr);
+        initMutex(&mutex, heap != NULL);
 
         MEMORY("Memory segment created");
         MEMORY("start address = %p", start);
@@ -94,6 +408,41 @@ struct Memory {
         return 0;
     }
 
+    // Takes over a heap whose blocks are already laid out, such as one mapped from a file written by saveHeap
+    void adopt(int *heap, size_t words, PlacementPolicy _policy) {
+        start = heap;
+        end = start + words;
+        size = words;
+        totalFree = 0;
+        numFreeBlocks = 0;
+        currMaxFree = 0;
+        for (int *p = start; p < end; p += *p >> 1) {
+            if ((*p & 1) == 0) {
+                totalFree += *p >> 1;
+                numFreeBlocks++;
+                currMaxFree = max(currMaxFree, (size_t)(*p >> 1));
+            }
+        }
+        peakUsed = size - totalFree;
+        policy = _policy;
+        free_index = (policy == BEST_FIT) ? new set<pair<u_int, u_int>>() : NULL;
+        move_idx = MAX_PT_ENTRIES;
+        copying.store(false, memory_order_relaxed);
+        move_cancel.store(false, memory_order_relaxed);
+        rebuildIndex();
+        initMutex(&mutex, false);
+        MEMORY("Adopted memory segment of %lu words at %p", size, start);
+    }
+
+    // Points start, end and rover into this process's mapping of the memory, which differs between processes sharing it
+    void rebase(int *heap) {
+        if (heap != start) {
+            rover = heap + (rover - start);
+            start = heap;
+            end = heap + size;
+        }
+    }
+
     // Absolute address to offset
     int getOffset(int *p) {
         return (int)(p - start);
@@ -104,14 +453,63 @@ struct Memory {
         return (start + offset);
     }
 
-    // Finds a free block of memory for sz words
-    int *findFreeBlock(size_t sz) {  // sz is the size required for the data (in words)
-        MEMORY("Finding free block for %lu word(s) of data", sz);
+    // Adds the free block at address p to the best fit index
+    void indexInsert(int *p) {
+        if (policy == BEST_FIT) {
+            free_index->insert(make_pair((u_int)(*p >> 1), (u_int)getOffset(p)));
+        }
+    }
+
+    // Removes the free block at address p from the best fit index
+    void indexErase(int *p) {
+        if (policy == BEST_FIT) {
+            free_index->erase(make_pair((u_int)(*p >> 1), (u_int)getOffset(p)));
+        }
+    }
+
+    // Rebuilds the best fit index and resets the next fit rover after the blocks have been rearranged
+    void rebuildIndex() {
+        rover = start;
+        if (policy != BEST_FIT) {
+            return;
+        }
+        free_index->clear();
         int *p = start;
-        while ((p < end) && ((*p & 1) || ((size_t)(*p >> 1) < sz + 2))) {  // keep on iterating till a suitable block is found
+        while (p < end) {
+            if ((*p & 1) == 0) {
+                indexInsert(p);
+            }
             p = p + (*p >> 1);
         }
-        if (p < end) {
+    }
+
+    // First free block in [from, to) that can hold sz words of data
+    int *scanFreeBlock(int *from, int *to, size_t sz) {
+        int *p = from;
+        while ((p < to) && ((*p & 1) || ((size_t)(*p >> 1) < sz + 2))) {  // keep on iterating till a suitable block is found
+            p = p + (*p >> 1);
+        }
+        return (p < to) ? p : NULL;
+    }
+
+    // Finds a free block of memory for sz words according to the placement policy
+    int *findFreeBlock(size_t sz) {  // sz is the size required for the data (in words)
+        MEMORY("Finding free block for %lu word(s) of data", sz);
+        int *p = NULL;
+        if (policy == BEST_FIT) {
+            auto it = free_index->lower_bound(make_pair((u_int)(sz + 2), 0u));  // smallest block that fits, lowest address on ties
+            if (it != free_index->end()) {
+                p = getAddr(it->second);
+            }
+        } else if (policy == NEXT_FIT) {
+            p = scanFreeBlock(rover, end, sz);
+            if (p == NULL) {
+                p = scanFreeBlock(start, rover, sz);
+            }
+        } else {
+            p = scanFreeBlock(start, end, sz);
+        }
+        if (p != NULL) {
             MEMORY("Found free block at %p", p);
             return p;
         } else {
@@ -123,6 +521,7 @@ struct Memory {
     // Allocates memory for sz words at address p and sets the appropriate headers and footers
     void allocateBlock(int *p, size_t sz) {  // sz is the size required for the data (in words)
         sz += 2;
+        indexErase(p);
         u_int old_size = *p >> 1;       // mask out low bit
         *p = (sz << 1) | 1;             // set new length and allocated bit for header
         *(p + sz - 1) = (sz << 1) | 1;  // same for footer
@@ -130,7 +529,9 @@ struct Memory {
         if (sz < old_size) {
             *(p + sz) = (old_size - sz) << 1;            // set length in remaining for header
             *(p + old_size - 1) = (old_size - sz) << 1;  // same for footer
+            indexInsert(p + sz);
         }
+        rover = (p + sz < end) ? p + sz : start;
 
         totalFree -= sz;
         if (sz == old_size) {
@@ -140,14 +541,81 @@ struct Memory {
             currMaxFree -= sz;
         }
         currMaxFree = max(currMaxFree, totalFree / (numFreeBlocks + 1));
+        peakUsed = max(peakUsed, size - totalFree);
         if (profiler_active) {
             fprintf(fp, "%ld\n", size - totalFree);
         }
         MEMORY("Allocated block at %p for %lu word(s) of data", p, sz - 2);
     }
 
-    // Deallocates the memory block at address p and sets the appropriate headers and footers
-    void freeBlock(int *p) {
+    // Carves n consecutive blocks out of the free block at p, sizes[i] words of data each, and writes their offsets to addrs
+    void allocateBlocks(int *p, const u_int *sizes, int n, u_int *addrs) {
+        indexErase(p);
+        u_int old_size = *p >> 1;
+        u_int used = 0;
+        for (int i = 0; i < n; i++) {
+            u_int sz = sizes[i] + 2;
+            int *q = p + used;
+            *q = (sz << 1) | 1;
+            *(q + sz - 1) = (sz << 1) | 1;
+            addrs[i] = getOffset(q);
+            used += sz;
+        }
+
+        if (used < old_size) {
+            *(p + used) = (old_size - used) << 1;
+            *(p + old_size - 1) = (old_size - used) << 1;
+            indexInsert(p + used);
+        }
+        rover = (p + used < end) ? p + used : start;
+
+        totalFree -= used;
+        if (used == old_size) {
+            numFreeBlocks--;
+        }
+        if (old_size == currMaxFree) {
+            currMaxFree -= used;
+        }
+        currMaxFree = max(currMaxFree, totalFree / (numFreeBlocks + 1));
+        peakUsed = max(peakUsed, size - totalFree);
+        if (profiler_active) {
+            fprintf(fp, "%ld\n", size - totalFree);
+        }
+        MEMORY("Allocated %d blocks at %p for %u word(s) in total", n, p, used);
+    }
+
+    // Shrinks the allocated block at p to sz words of data, freeing the tail
+    void shrinkBlock(int *p, size_t sz) {
+        sz += 2;
+        u_int old_size = *p >> 1;
+        if (sz >= old_size) {
+            return;
+        }
+        *p = (sz << 1) | 1;
+        *(p + sz - 1) = (sz << 1) | 1;
+        int *tail = p + sz;
+        *tail = ((old_size - sz) << 1) | 1;  // make the tail a block of its own so that freeBlock coalesces it
+        *(p + old_size - 1) = ((old_size - sz) << 1) | 1;
+        freeBlock(tail);
+        MEMORY("Shrunk block at %p to %lu word(s) of data", p, sz - 2);
+    }
+
+    // Size in words that the block at p would have after coalescing with its free neighbours
+    size_t coalescedSize(int *p) {
+        size_t sz = *p >> 1;
+        int *next = p + sz;
+        if (next != end && (*next & 1) == 0) {
+            sz += *next >> 1;
+        }
+        if (p != start && (*(p - 1) & 1) == 0) {
+            sz += *(p - 1) >> 1;
+        }
+        return sz;
+    }
+
+    // Deallocates the memory block at address p and sets the appropriate headers and footers. Returns the free block
+    // it ended up in after coalescing
+    int *freeBlock(int *p) {
         MEMORY("Freeing block at %p", p);
         *p = *p & -2;  // clear allocated flag in header
         u_int curr_size = *p >> 1;
@@ -159,6 +627,10 @@ struct Memory {
         int *next = p + curr_size;                // find next block
         if ((next != end) && (*next & 1) == 0) {  // if next block is free
             MEMORY("Coalescing with next block at %p", next);
+            indexErase(next);
+            if (rover == next) {
+                rover = p;
+            }
             u_int next_size = *next >> 1;
             *p = (curr_size + next_size) << 1;                                // merge with next block
             *(p + curr_size + next_size - 1) = (curr_size + next_size) << 1;  // set length in footer
@@ -169,126 +641,261 @@ struct Memory {
         if ((p != start) && (*(p - 1) & 1) == 0) {  // if previous block is free
             u_int prev_size = *(p - 1) >> 1;
             MEMORY("Coalescing with previous block at %p", (p - prev_size));
+            indexErase(p - prev_size);
+            if (rover == p) {
+                rover = p - prev_size;
+            }
             *(p - prev_size) = (prev_size + curr_size) << 1;      // set length in header of prev
             *(p + curr_size - 1) = (prev_size + curr_size) << 1;  // set length in footer
             numFreeBlocks--;
             curr_size += prev_size;
+            p = p - prev_size;
         }
+        indexInsert(p);
 
         currMaxFree = max(currMaxFree, (size_t)curr_size);
         currMaxFree = max(currMaxFree, totalFree / (numFreeBlocks + 1));
         if (profiler_active) {
             fprintf(fp, "%ld\n", size - totalFree);
         }
+        return p;
+    }
+
+    // Size of the largest free block (in words), from the index for best fit and by walking the blocks otherwise
+    size_t largestFreeBlock() {
+        if (policy == BEST_FIT) {
+            return free_index->empty() ? 0 : free_index->rbegin()->first;
+        }
+        size_t largest = 0;
+        int *p = start;
+        while (p < end) {
+            if ((*p & 1) == 0) {
+                largest = max(largest, (size_t)(*p >> 1));
+            }
+            p = p + (*p >> 1);
+        }
+        return largest;
     }
 
     // Display the current memory blocks
     void displayMem() {
-#ifdef LOGS
+        if (log_level.load(memory_order_relaxed) < LOG_DEBUG) {
+            return;
+        }
         int *p = start;
-        printf("   Start      End    Allocated\n");
+        logWrite("   Start      End    Allocated\n");
         while (p < end) {
-            printf("%7ld %9ld %10d\n", p - start, (p - start - 1) + (*p >> 1), *p & 1);
+            logWrite("%7ld %9ld %10d\n", p - start, (p - start - 1) + (*p >> 1), *p & 1);
             p = p + (*p >> 1);
         }
-        printf("Total free memory = %ld words, Largest free block = %ld words, No. of free blocks = %d\n", totalFree, currMaxFree, numFreeBlocks);
-#endif
+        logWrite("Total free memory = %ld words, Largest free block = %ld words, No. of free blocks = %d\n", totalFree, currMaxFree, numFreeBlocks);
     }
 };
 
+// A counter is | generation (16 bits) | shard (3 bits) | index in page table array (10 bits) | 00 |
+// The generation changes every time a page table entry is reused, so stale counters can be told apart
+const u_int IDX_BITS = 10;
+const u_int SHARD_BITS = 3;
+const u_int GEN_MASK = (1u << 16) - 1;
+
 // Counter to index in page table array
 u_int counterToIdx(u_int p) {
-    return (p >> 2);
+    return (p >> 2) & ((1u << IDX_BITS) - 1);
+}
+
+// Counter to shard whose page table holds the entry
+u_int counterToShard(u_int p) {
+    return (p >> (IDX_BITS + 2)) & ((1u << SHARD_BITS) - 1);
 }
 
-// Index in page table array to counter
-u_int idxToCounter(u_int p) {
-    return (p << 2);
+// Counter to generation of the page table entry
+u_int counterToGen(u_int p) {
+    return p >> (IDX_BITS + SHARD_BITS + 2);
 }
 
+// Index in page table array, generation and shard to counter
+u_int idxToCounter(u_int p, u_int gen, u_int shard) {
+    return ((gen & GEN_MASK) << (IDX_BITS + SHARD_BITS + 2)) | (shard << (IDX_BITS + 2)) | (p << 2);
+}
+
+// Flags in PageTableEntry::state, the bits above them hold the generation
+const u_int PT_VALID = 1;
+const u_int PT_MARKED = 2;
+const u_int PT_GARBAGE = 4;  // found unreachable by the collector and queued for lazy sweeping
+const u_int PT_MOVING = 8;   // being copied by the concurrent compactor, cleared by a write to abort the move
+const u_int PT_REFERENCED = 16;  // set by array accesses, cleared by the CLOCK hand choosing arrays to spill
+const u_int PT_GEN_SHIFT = 5;
+
 struct PageTableEntry {
-    u_int addr : 30;
-    u_int valid : 1;
-    u_int marked : 1;
+    u_int addr;            // protected by mem->mutex
+    u_int data_type;       // set before the entry is made valid
+    u_int len;             // elements of the array, 1 for a variable, changed by resizeArr, protected by mem->mutex
+    u_int share_next;      // next entry in the ring of copy-on-write clones sharing the block, protected by mem->mutex
+    u_int site;            // allocation site for the site profiler or NO_SITE, protected by mem->mutex
+    u_int birth;           // garbage collection cycle the entry was created in, if it has a site
+    u_int last_use;        // nowMs of the last readArr/assignArr, protected by mem->mutex
+    u_int raw_words;       // data words of the array before it was compressed, 0 if it is not, protected by mem->mutex
+    u_int spill_words;     // data words of the array in the backing file, 0 if it is in the heap, protected by mem->mutex
+    size_t spill_off;      // word offset in the backing file of a spilled array
+    atomic<u_int> heat;    // sampled accesses, see recordAccess
+    atomic<u_int> state;   // PT_VALID | PT_MARKED | PT_GARBAGE | PT_MOVING | PT_REFERENCED | generation << PT_GEN_SHIFT
+    atomic<u_int> next;    // next entry in the free list while the entry is free
 
     void init() {
         addr = 0;
-        valid = 0;
-        marked = 0;
+        data_type = 0;
+        len = 0;
+        share_next = 0;
+        site = NO_SITE;
+        birth = 0;
+        last_use = 0;
+        raw_words = 0;
+        spill_words = 0;
+        heat.store(0, memory_order_relaxed);
+        state.store(0, memory_order_relaxed);
+        next.store(0, memory_order_relaxed);
+    }
+
+    bool valid() {
+        return state.load(memory_order_acquire) & PT_VALID;
+    }
+
+    bool marked() {
+        return state.load(memory_order_acquire) & PT_MARKED;
+    }
+
+    u_int gen() {
+        return (state.load(memory_order_acquire) >> PT_GEN_SHIFT) & GEN_MASK;
     }
 
     void print() {
-        printf("%10d %6d %6d\n", addr, valid, marked);
+        printf("%10d %6d %6d\n", addr, valid(), marked());
     }
 };
 
+// The free entries form a Treiber stack threaded through PageTableEntry::next. The head holds the index of the
+// top entry in its low 32 bits and a tag in the high 32 bits that is bumped on every update to prevent ABA. An
+// allocation reserves its entry before it locks the memory and only fills it in under the lock, so threads
+// allocating in the same shard do not queue on the lock for the entry.
 struct PageTable {
     PageTableEntry pt[MAX_PT_ENTRIES];
-    u_int head, tail;
-    size_t size;
-    pthread_mutex_t mutex;
-
-    void init() {
+    atomic<uint64_t> free_head;
+    atomic<size_t> size;
+    u_int shard;                    // goes into the counters of the entries
+    u_int clock_hand;               // next entry the CLOCK hand looks at when choosing arrays to spill, protected by mem->mutex
+    u_int garbage[MAX_PT_ENTRIES];  // counters of the entries waiting to be swept (those with PT_GARBAGE), in order of address
+    size_t num_garbage;             // garbage and num_garbage are protected by mem->mutex
+
+    void init(u_int _shard) {
+        shard = _shard;
+        clock_hand = 0;
         for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
             pt[i].init();
-            pt[i].addr = i + 1;
+            pt[i].next.store(i + 1, memory_order_relaxed);  // MAX_PT_ENTRIES marks the end of the list
         }
-        head = 0;
-        tail = MAX_PT_ENTRIES - 1;
-        size = 0;
-        pthread_mutexattr_t attr;
-        pthread_mutexattr_init(&attr);
-        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK_NP);
-        pthread_mutex_init(&mutex, &attr);
+        free_head.store(0, memory_order_relaxed);
+        size.store(0, memory_order_relaxed);
+        num_garbage = 0;
         PAGE_TABLE("Page table initialized");
     }
 
-    // Adds a new entry to the page table
-    int insert(u_int addr) {
-        if (size == MAX_PT_ENTRIES) {
-            PAGE_TABLE("Page table is full, insert failed");
-            return -1;
+    // Pops n free entries off the stack with one update of its head and writes their indices to idxs. Called before
+    // the memory is locked, so that allocating threads only meet on the CAS. The entries stay invalid until fill, or
+    // go back with release. Returns -1 if the page table does not have n free entries.
+    int reserve(int n, u_int *idxs) {
+        uint64_t head = free_head.load(memory_order_acquire);
+        while (1) {
+            u_int idx = (u_int)head;
+            int i = 0;
+            for (; i < n && idx < MAX_PT_ENTRIES; i++) {  // a stale walk is caught by the CAS, the tag has changed
+                idxs[i] = idx;
+                idx = pt[idx].next.load(memory_order_relaxed);
+            }
+            if (i < n) {
+                uint64_t now = free_head.load(memory_order_acquire);
+                if (now != head) {  // ran off a stale chain
+                    head = now;
+                    continue;
+                }
+                PAGE_TABLE("Page table cannot hold %d more entries, reserve failed", n);
+                return -1;
+            }
+            uint64_t new_head = (((head >> 32) + 1) << 32) | idx;
+            if (free_head.compare_exchange_weak(head, new_head, memory_order_acq_rel, memory_order_acquire)) {
+                break;
+            }
         }
-        u_int idx = head;
-        u_int next = pt[head].addr;
+        size.fetch_add(n, memory_order_relaxed);
+        return 0;
+    }
+
+    // Pushes a reserved or removed entry back on the stack
+    void release(u_int idx) {
+        uint64_t head = free_head.load(memory_order_acquire);
+        uint64_t new_head;
+        do {
+            pt[idx].next.store((u_int)head, memory_order_relaxed);
+            new_head = (((head >> 32) + 1) << 32) | idx;
+        } while (!free_head.compare_exchange_weak(head, new_head, memory_order_release, memory_order_acquire));
+        size.fetch_sub(1, memory_order_relaxed);
+    }
+
+    // Makes a reserved entry valid and returns its counter, the entry starts out marked. Called with the memory locked
+    int fill(u_int idx, u_int addr, DataType data_type, u_int len) {
         pt[idx].addr = addr;
-        pt[idx].valid = 1;
-        pt[idx].marked = 1;
-        size++;
-        if (size < MAX_PT_ENTRIES) {
-            head = next;
-        } else {
-            head = MAX_PT_ENTRIES;
-            tail = MAX_PT_ENTRIES;
-        }
+        pt[idx].data_type = data_type;
+        pt[idx].len = len;
+        pt[idx].share_next = idx;
+        pt[idx].site = NO_SITE;
+        pt[idx].last_use = nowMs();
+        pt[idx].raw_words = 0;
+        pt[idx].spill_words = 0;
+        pt[idx].heat.store(0, memory_order_relaxed);
+        u_int gen = (pt[idx].gen() + 1) & GEN_MASK;
+        pt[idx].state.store((gen << PT_GEN_SHIFT) | PT_VALID | PT_MARKED | PT_REFERENCED, memory_order_release);
         PAGE_TABLE("Inserted new page table entry with memory offset %d at array index %d", addr, idx);
-        return idx;
+        return idxToCounter(idx, gen, shard);
     }
 
     // Removes an entry from the page table
     int remove(u_int idx) {
-        if (size == 0 || !pt[idx].valid) {
-            PAGE_TABLE("Page table is empty or entry index %d is invalid, remove failed", idx);
-            return -1;
-        }
-        pt[idx].valid = 0;
-        pt[tail].addr = idx;
-        tail = idx;
-        size--;
-        if (size == MAX_PT_ENTRIES - 1) {
-            head = tail;
-        }
+        u_int st = pt[idx].state.load(memory_order_acquire);
+        do {
+            if (!(st & PT_VALID)) {
+                PAGE_TABLE("Entry index %d is invalid, remove failed", idx);
+                return -1;
+            }
+        } while (!pt[idx].state.compare_exchange_weak(st, st & ~(PT_VALID | PT_MARKED | PT_GARBAGE | PT_MOVING | PT_REFERENCED), memory_order_acq_rel, memory_order_acquire));
+        release(idx);
         PAGE_TABLE("Removed entry with array index %d in the page table", idx);
         return 0;
     }
 
+    // Whether the counter refers to a live entry, i.e. the entry is valid and has not been reused since
+    bool isValid(u_int counter) {
+        u_int st = pt[counterToIdx(counter)].state.load(memory_order_acquire);
+        return (st & PT_VALID) && ((st >> PT_GEN_SHIFT) & GEN_MASK) == counterToGen(counter);
+    }
+
+    // Clears the mark bit of the entry for counter, unless the entry has been freed or reused since
+    void unmark(u_int counter) {
+        PageTableEntry &e = pt[counterToIdx(counter)];
+        u_int st = e.state.load(memory_order_acquire);
+        do {
+            if (!(st & PT_VALID) || ((st >> PT_GEN_SHIFT) & GEN_MASK) != counterToGen(counter)) {
+                return;
+            }
+        } while (!e.state.compare_exchange_weak(st, st & ~PT_MARKED, memory_order_acq_rel, memory_order_acquire));
+        PAGE_TABLE("Unmarked entry in page table for variable with counter = %d", counter);
+    }
+
     // Display the contents of the page table
     void print() {
         printf("\nPage Table:\n");
-        printf("Head: %d, Tail: %d, Size: %lu\n", head, tail, size);
+        printf("Free list head: %u, Size: %lu\n", (u_int)free_head.load(), size.load());
         printf("Index     Entry  Valid  Marked\n");
         for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
-            if (pt[i].valid) {
+            if (pt[i].valid()) {
                 printf("%3ld ", i);
                 pt[i].print();
             }
@@ -299,6 +906,7 @@ struct PageTable {
 struct Stack {
     int st[MAX_STACK_SIZE];
     size_t size;
+    Stack *next;  // next stack in the registry of all threads' stacks
 
     void init() {
         size = 0;
@@ -322,6 +930,18 @@ struct Stack {
         return 0;
     }
 
+    // Pushes n values, or none if they do not all fit
+    int pushBatch(const int *v, int n) {
+        if (size + n > MAX_STACK_SIZE) {
+            STACK("Stack cannot hold %d more values, push failed", n);
+            return -2;
+        }
+        memcpy(st + size, v, n * sizeof(int));
+        size += n;
+        STACK("Pushed %d values onto stack", n);
+        return 0;
+    }
+
     int pop() {
         if (size == 0) {
             STACK("Stack is empty, pop failed");
@@ -333,7 +953,7 @@ struct Stack {
     }
 
     void print() {
-        printf("\nGlobal Variable Stack:\n");
+        printf("\nVariable Stack:\n");
         printf("Size: %lu\n", size);
         for (size_t i = 0; i < size; i++) {
             printf("%d ", st[i]);
@@ -342,32 +962,885 @@ struct Stack {
     }
 };
 
-Memory *mem;
-PageTable *page_table;
-Stack *var_stack;
+// With createMem(..., num_shards) the memory is split into shards, each with its own heap, page table and lock.
+// Threads allocate from a home shard and the counter of a variable says which shard it is in. The library functions
+// work on the shard selected in mem and page_table for the calling thread.
+const size_t MAX_SHARDS = 1 << SHARD_BITS;
+
+struct Shard {
+    Memory *mem;
+    PageTable *page_table;
+};
+
+Shard shards[MAX_SHARDS];
+size_t num_shards;  // 0 until the memory is created
+thread_local Memory *mem;
+thread_local PageTable *page_table;
+thread_local int home_shard = -1;
+
+void selectShard(u_int s) {
+    mem = shards[s].mem;
+    page_table = shards[s].page_table;
+}
+
+// Selects the shard holding the variable with this counter
+void selectShardOf(u_int counter) {
+    u_int s = counterToShard(counter);
+    selectShard(s < num_shards ? s : 0);  // a bogus counter is then rejected as invalid by shard 0
+}
+
+// Shard the calling thread allocates from, threads are spread over the shards by thread id
+u_int homeShard() {
+    if (home_shard < 0) {
+        home_shard = syscall(SYS_gettid) % num_shards;
+    }
+    return home_shard;
+}
+
+thread_local Stack *var_stack;  // scope stack of the calling thread, created on first use
+Stack *stacks;                  // registry of the scope stacks of all threads
+pthread_mutex_t stacks_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stack_key;  // runs releaseStack when a thread with a scope stack exits
+pthread_once_t stack_once = PTHREAD_ONCE_INIT;  // the key is created by the first getStack, which may come before the memory
 pthread_t gc_tid;
 sem_t gc_sem;
 
-void freeElem(u_int idx) {
+// Layout of a shared memory segment: this header followed by the heap
+struct SharedSegment {
+    char magic[8];
+    atomic<int> ready;  // set by the creator once the segment is initialized
+    int num_attached;   // protected by mem.mutex
+    size_t length;      // of the whole segment in bytes
+    size_t bytes;       // size of memory as requested in createSharedMem
+    Memory mem;
+    PageTable page_table;
+};
+
+SharedSegment *shm_seg;
+string shm_name;
+
+// Locks the memory, pointing it into this process's mapping first if it is shared
+void lockMem() {
+    LOCK(&mem->mutex);
+    if (shm_seg != NULL) {
+        mem->rebase((int *)(shm_seg + 1));
+    }
+}
+
+size_t mem_bytes;  // size of memory as requested in createMem
+size_t heap_map_len;  // length of the heap mapping if it was loaded with loadHeap, otherwise it was malloc'ed
+atomic<FILE *> trace_fp;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Appends a record to the allocation trace, costs a single load when tracing is off
+void traceRecord(TraceOp op, DataType data_type = INT, u_int ind = 0, u_int len = 0) {
+    if (trace_fp.load(memory_order_relaxed) == NULL) {
+        return;
+    }
+    TraceRecord rec = {(uint8_t)op, (uint8_t)data_type, 0, ind, len};
+    LOCK(&trace_mutex);
+    FILE *f = trace_fp.load(memory_order_relaxed);
+    if (f != NULL) {
+        fwrite(&rec, sizeof(rec), 1, f);
+    }
+    UNLOCK(&trace_mutex);
+}
+
+void traceStart(string file) {
+    LIBRARY("traceStart called with file = %s", file.c_str());
+    if (num_shards == 0) {
+        throw runtime_error("traceStart: Memory not created");
+    }
+    FILE *f = fopen(file.c_str(), "wb");
+    if (f == NULL) {
+        throw runtime_error("traceStart: Cannot open " + file);
+    }
+    TraceHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, 4);
+    hdr.version = TRACE_VERSION;
+    hdr.bytes = mem_bytes;
+    hdr.gc_active = gc_active;
+    hdr.policy = mem->policy;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    LOCK(&trace_mutex);
+    FILE *old = trace_fp.exchange(f);
+    UNLOCK(&trace_mutex);
+    if (old != NULL) {
+        fclose(old);
+    }
+}
+
+void traceStop() {
+    LIBRARY("traceStop called");
+    LOCK(&trace_mutex);
+    FILE *f = trace_fp.exchange(NULL);
+    UNLOCK(&trace_mutex);
+    if (f != NULL) {
+        fclose(f);
+    }
+}
+
+// Allocation site profiler: one in every site_sample_every createVar/createArr calls records its caller's address
+// in the page table entry, and the per site counters are updated when the object is created, resized and freed.
+struct AllocSite {
+    atomic<void *> pc;  // return address into the caller of createVar/createArr, NULL while the slot is unused
+    atomic<size_t> allocs;
+    atomic<size_t> frees;
+    atomic<size_t> live_bytes;
+    atomic<size_t> lifetime_total;  // in garbage collection cycles, over the freed objects
+};
+
+AllocSite sites[MAX_SITES];
+atomic<int> site_sample_every(0);  // 0 while the profiler is off
+thread_local int site_countdown = 0;
+thread_local u_int rand_state = 2463534242u;
+
+// Cheap xorshift generator for the sampling gaps
+inline u_int fastRand() {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+// Whether this allocation should be sampled, a single branch while the profiler is off
+inline bool siteSample() {
+    int every = site_sample_every.load(memory_order_relaxed);
+    if (__builtin_expect(every == 0, 1)) {
+        return false;
+    }
+    if (--site_countdown > 0) {
+        return false;
+    }
+    // Random gaps averaging every, a fixed one could keep hitting the same call in a loop
+    site_countdown = 1 + fastRand() % (2 * every - 1);
+    return true;
+}
+
+// Slot of the site with return address pc, from an open addressed table. NO_SITE if the table is full
+u_int siteLookup(void *pc) {
+    u_int h = (u_int)(((uintptr_t)pc >> 2) * 2654435761u) % MAX_SITES;
+    for (size_t i = 0; i < MAX_SITES; i++) {
+        AllocSite &site = sites[(h + i) % MAX_SITES];
+        void *curr = site.pc.load(memory_order_acquire);
+        if (curr == NULL && site.pc.compare_exchange_strong(curr, pc, memory_order_acq_rel)) {
+            return (h + i) % MAX_SITES;
+        }
+        if (curr == pc) {
+            return (h + i) % MAX_SITES;
+        }
+    }
+    return NO_SITE;
+}
+
+// Access heat: one in every ACCESS_SAMPLE_EVERY reads and writes (on average) adds to the heat of the entry, and the
+// garbage collector halves all of them every HEAT_DECAY_CYCLES cycles so that heat follows recent use. Called with
+// the shard of counter selected.
+thread_local int access_countdown = ACCESS_SAMPLE_EVERY;
+
+inline void recordAccess(u_int counter) {
+    if (--access_countdown > 0) {
+        return;
+    }
+    access_countdown = 1 + fastRand() % (2 * ACCESS_SAMPLE_EVERY - 1);
+    page_table->pt[counterToIdx(counter)].heat.fetch_add(1, memory_order_relaxed);
+}
+
+// Accounts for the freeing of entry idx if it was sampled. Called with the memory locked, before the entry is removed
+void siteFree(u_int idx) {
+    PageTableEntry &e = page_table->pt[idx];
+    if (e.site == NO_SITE) {
+        return;
+    }
+    AllocSite &site = sites[e.site];
+    statAdd(site.frees, 1);
+    site.live_bytes.fetch_sub((*mem->getAddr(e.addr) >> 1) << 2, memory_order_relaxed);
+    statAdd(site.lifetime_total, statGet(stats.gc_cycles) - e.birth);
+    e.site = NO_SITE;
+}
+
+void siteProfileStart(int sample_every) {
+    LIBRARY("siteProfileStart called with sample_every = %d", sample_every);
+    if (shm_seg != NULL) {
+        throw runtime_error("siteProfileStart: Sites cannot be profiled in shared memory");
+    }
+    site_sample_every.store(max(sample_every, 1), memory_order_relaxed);
+}
+
+void siteProfileStop() {
+    LIBRARY("siteProfileStop called");
+    site_sample_every.store(0, memory_order_relaxed);
+}
+
+void siteProfileDump(FILE *out, int top) {
+    vector<u_int> order;
+    for (u_int i = 0; i < MAX_SITES; i++) {
+        if (sites[i].pc.load(memory_order_acquire) != NULL) {
+            order.push_back(i);
+        }
+    }
+    sort(order.begin(), order.end(), [](u_int a, u_int b) { return statGet(sites[a].live_bytes) > statGet(sites[b].live_bytes); });
+    if ((int)order.size() > top) {
+        order.resize(top);
+    }
+    fprintf(out, "%12s %12s %12s %14s  %s\n", "live", "live bytes", "allocs", "avg lifetime", "site");
+    for (u_int i : order) {
+        AllocSite &site = sites[i];
+        size_t allocs = statGet(site.allocs), frees = statGet(site.frees);
+        double lifetime = (frees == 0) ? 0 : (double)statGet(site.lifetime_total) / frees;
+        void *pc = site.pc.load(memory_order_relaxed);
+        char **sym = backtrace_symbols(&pc, 1);  // binary(+offset), which addr2line turns into a source line
+        fprintf(out, "%12zu %12zu %12zu %14.2f  %s\n", allocs - frees, statGet(site.live_bytes), allocs, lifetime, sym ? sym[0] : "?");
+        free(sym);
+    }
+}
+
+// Whether other page table entries (copy-on-write clones) share the block of entry idx
+bool isShared(u_int idx) {
+    return page_table->pt[idx].share_next != idx;
+}
+
+// Takes entry idx out of the ring of entries sharing its block. Called with the memory locked
+void unlinkShared(u_int idx) {
+    u_int prev = idx;
+    while (page_table->pt[prev].share_next != idx) {
+        prev = page_table->pt[prev].share_next;
+    }
+    page_table->pt[prev].share_next = page_table->pt[idx].share_next;
+    page_table->pt[idx].share_next = idx;
+}
+
+void compactMemory();
+int *findFreeBlockSweeping(size_t sz);
+int *spillForBlock(size_t sz, u_int keep);
+void compactorStop();
+
+// Gives entry idx a private copy of its block if the block is shared. Called with the memory locked
+void unshare(u_int idx) {
+    if (!isShared(idx)) {
+        return;
+    }
+    int *p = mem->getAddr(page_table->pt[idx].addr);
+    size_t words = (*p >> 1) - 2;
+    int *q = findFreeBlockSweeping(words);
+    if (!page_table->pt[idx].valid()) {  // written to after its scope ended and swept just now
+        UNLOCK(&mem->mutex);
+        throw runtime_error("Copy-on-write: Variable has been freed");
+    }
+    if (q == NULL) {
+        MEMORY("Could not find free block, trying compaction");
+        compactMemory();
+        p = mem->getAddr(page_table->pt[idx].addr);
+        q = mem->findFreeBlock(words);
+        if (q == NULL) {
+            UNLOCK(&mem->mutex);
+            throw runtime_error("Copy-on-write: No free block in memory for a private copy");
+        }
+    }
+    mem->allocateBlock(q, words);
+    memcpy(q + 1, p + 1, words << 2);
+    unlinkShared(idx);
+    page_table->pt[idx].addr = mem->getOffset(q);
+    statAdd(stats.cow_copies, 1);
+    MEMORY("Copied shared block at %p to %p for writing", p, q);
+}
+
+// Makes the concurrent compactor discard its copy of the block of entry idx, if it is making one. Called with the
+// memory locked before the block is written or gets another sharer
+void abortMove(u_int idx, const char *why) {
+    if (page_table->pt[idx].state.load(memory_order_relaxed) & PT_MOVING) {
+        page_table->pt[idx].state.fetch_and(~PT_MOVING, memory_order_relaxed);
+        MEMORY("%s of entry %u aborted its concurrent move", why, idx);
+    }
+}
+
+// Address of the block of entry idx for writing, unsharing it first and aborting a concurrent move of it. Called
+// with the memory locked
+int *writableAddr(u_int idx) {
+    abortMove(idx, "Write");  // the copy being made would be stale
+    unshare(idx);
+    return mem->getAddr(page_table->pt[idx].addr);
+}
+
+// Accounts for a change in the size of the block of entry idx, from old_words, if the site profiler sampled it
+void siteResized(u_int idx, size_t old_words) {
+    PageTableEntry &e = page_table->pt[idx];
+    if (e.site != NO_SITE) {  // the difference wraps around for a shrink
+        statAdd(sites[e.site].live_bytes, ((*mem->getAddr(e.addr) >> 1) - old_words) << 2);
+    }
+}
+
+// Changes the block of entry idx to hold new_words of data and returns it. The block grows in place into a free next
+// block, or also into a free previous block by moving the data down with one memmove; only if neither has room is the
+// data copied to a new block. Called with the memory locked, which is unlocked before throwing.
+int *resizeBlock(u_int idx, size_t new_words, const char *func) {
+    int *p = writableAddr(idx);
+    size_t old_words = (*p >> 1) - 2;
+    if (new_words <= old_words) {
+        mem->shrinkBlock(p, new_words);
+    } else if (mem->coalescedSize(p) >= new_words + 2) {
+        int *q = ((p != mem->start) && (*(p - 1) & 1) == 0) ? p - (*(p - 1) >> 1) : p;
+        mem->freeBlock(p);  // coalesces with the neighbours into one free block at q, the data stays where it is
+        if (q != p) {
+            memmove(q + 1, p + 1, old_words << 2);
+            statAdd(stats.bytes_moved, old_words << 2);
+            MEMORY("Moved %lu word(s) of data down from %p to %p", old_words, p, q);
+        }
+        mem->allocateBlock(q, new_words);
+        page_table->pt[idx].addr = mem->getOffset(q);
+    } else {
+        int *q = findFreeBlockSweeping(new_words);
+        if (!page_table->pt[idx].valid()) {  // resized after its scope ended and swept just now
+            UNLOCK(&mem->mutex);
+            throw runtime_error(string(func) + ": Array has been freed");
+        }
+        if (q == NULL) {
+            MEMORY("Could not find free block, trying compaction");
+            compactMemory();
+            q = mem->findFreeBlock(new_words);
+            if (q == NULL) {
+                q = spillForBlock(new_words, idx);
+            }
+            if (q == NULL) {
+                UNLOCK(&mem->mutex);
+                throw runtime_error(string(func) + ": No free block in memory");
+            }
+            p = mem->getAddr(page_table->pt[idx].addr);
+        }
+        mem->allocateBlock(q, new_words);
+        memcpy(q + 1, p + 1, old_words << 2);
+        statAdd(stats.bytes_moved, old_words << 2);
+        mem->freeBlock(p);
+        page_table->pt[idx].addr = mem->getOffset(q);
+    }
+    siteResized(idx, old_words + 2);
+    return mem->getAddr(page_table->pt[idx].addr);
+}
+
+// Cold array compression: the garbage collector compresses CHAR and BOOLEAN arrays that no readArr/assignArr has
+// used for cold_ms milliseconds in place, shrinking their blocks, and the next access decompresses them. Booleans are
+// stored as the lengths of their runs of equal bits and chars with a small LZ77 codec. A compressed block holds the
+// compressed length in bytes followed by the compressed data; the page table entry keeps the original data words.
+atomic<size_t> cold_ms(0);  // 0 while compression is off
+
+// Appends v as a LEB128 varint, false if it does not fit in cap bytes
+inline bool putVarint(uint8_t *out, size_t &len, size_t cap, size_t v) {
+    do {
+        if (len == cap) {
+            return false;
+        }
+        out[len++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        v >>= 7;
+    } while (v != 0);
+    return true;
+}
+
+inline size_t getVarint(const uint8_t *in, size_t &pos) {
+    size_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = in[pos++];
+        v |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+}
+
+// Lengths of the alternating runs of 0 and 1 bits, starting with 0s. Returns the compressed length, 0 if it is more than cap
+size_t bitRunsEncode(const u_int *in, size_t words, uint8_t *out, size_t cap) {
+    size_t len = 0, run = 0;
+    u_int bit = 0;
+    for (size_t i = 0; i < words; i++) {
+        u_int w = bit ? ~in[i] : in[i];  // set where the run ends
+        u_int pos = 0;
+        while (pos < 32) {
+            u_int rest = w >> pos;
+            u_int n = (rest == 0) ? 32 - pos : __builtin_ctz(rest);
+            run += n;
+            pos += n;
+            if (pos < 32) {
+                if (!putVarint(out, len, cap, run)) {
+                    return 0;
+                }
+                run = 0;
+                bit ^= 1;
+                w = ~w;
+            }
+        }
+    }
+    return putVarint(out, len, cap, run) ? len : 0;
+}
+
+void bitRunsDecode(const uint8_t *in, u_int *out, size_t words) {
+    memset(out, 0, words << 2);
+    size_t bit = 0, pos = 0, total = words << 5;
+    bool ones = false;
+    while (bit < total) {
+        size_t end = bit + getVarint(in, pos);
+        if (ones) {
+            for (; bit < end; bit++) {
+                if ((bit & 31) == 0 && end - bit >= 32) {
+                    out[bit >> 5] = ~0u;
+                    bit += 31;
+                } else {
+                    out[bit >> 5] |= 1u << (bit & 31);
+                }
+            }
+        }
+        bit = end;
+        ones = !ones;
+    }
+}
+
+// LZ77 with a single hash table lookup per position: a sequence of (literal count, literals, match offset in 2
+// bytes, match length - 4), ending with a literal count and literals. Returns the compressed length, 0 if it is more
+// than cap
+size_t lzEncode(const uint8_t *in, size_t n, uint8_t *out, size_t cap) {
+    vector<u_int> table(1 << LZ_HASH_BITS, 0);  // last position + 1 of every hashed 4 bytes
+    size_t len = 0, lit = 0, i = 0;
+    while (i + 4 <= n) {
+        uint32_t v;
+        memcpy(&v, in + i, 4);
+        u_int h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = i + 1;
+        if (cand == 0 || i - (cand - 1) > 0xffff || memcmp(in + cand - 1, in + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t m = cand - 1, mlen = 4;
+        while (i + mlen < n && in[m + mlen] == in[i + mlen]) {
+            mlen++;
+        }
+        if (!putVarint(out, len, cap, i - lit) || len + (i - lit) + 2 > cap) {
+            return 0;
+        }
+        memcpy(out + len, in + lit, i - lit);
+        len += i - lit;
+        out[len++] = (i - m) & 0xff;
+        out[len++] = (i - m) >> 8;
+        if (!putVarint(out, len, cap, mlen - 4)) {
+            return 0;
+        }
+        i += mlen;
+        lit = i;
+    }
+    if (!putVarint(out, len, cap, n - lit) || len + (n - lit) > cap) {
+        return 0;
+    }
+    memcpy(out + len, in + lit, n - lit);
+    return len + (n - lit);
+}
+
+void lzDecode(const uint8_t *in, uint8_t *out, size_t n) {
+    size_t pos = 0, op = 0;
+    while (1) {
+        size_t lit = getVarint(in, pos);
+        memcpy(out + op, in + pos, lit);
+        pos += lit;
+        op += lit;
+        if (op >= n) {
+            return;
+        }
+        size_t off = in[pos] | (in[pos + 1] << 8);
+        pos += 2;
+        size_t mlen = getVarint(in, pos) + 4;
+        for (size_t k = 0; k < mlen; k++, op++) {  // byte by byte, the match may overlap what it produces
+            out[op] = out[op - off];
+        }
+    }
+}
+
+// Compresses the array of entry idx in place if that frees at least a quarter of its block. Called with the memory locked
+bool compressArr(u_int idx) {
+    PageTableEntry &e = page_table->pt[idx];
+    int *p = writableAddr(idx);  // a concurrent move would copy the uncompressed data
+    size_t words = (*p >> 1) - 2;
+    size_t cap = (((words * 3) >> 2) - 1) << 2;  // so that the length word and the data take at most 3/4 of it
+    vector<uint8_t> buf(cap);
+    size_t clen = (e.data_type == BOOLEAN) ? bitRunsEncode((u_int *)(p + 1), words, buf.data(), cap)
+                                           : lzEncode((uint8_t *)(p + 1), words << 2, buf.data(), cap);
+    if (clen == 0) {
+        return false;
+    }
+    p[1] = clen;
+    memcpy(p + 2, buf.data(), clen);
+    mem->shrinkBlock(p, 1 + ((clen + 3) >> 2));
+    e.raw_words = words;
+    siteResized(idx, words + 2);
+    statAdd(stats.compressed_arrays, 1);
+    statAdd(stats.compression_bytes_saved, (words + 2 - (*p >> 1)) << 2);
+    MEMORY("Compressed %s array of entry %u from %lu to %u word(s)", getDataTypeStr((DataType)e.data_type).c_str(), idx, words, (*p >> 1) - 2);
+    return true;
+}
+
+// Restores the compressed array of entry idx to its original size. Called with the memory locked, which is unlocked
+// before throwing
+void decompressArr(u_int idx, const char *func) {
+    PageTableEntry &e = page_table->pt[idx];
+    int *p = mem->getAddr(e.addr);
+    size_t words = e.raw_words;
+    size_t saved = (words + 2 - (*p >> 1)) << 2;
+    vector<uint8_t> buf((uint8_t *)(p + 2), (uint8_t *)(p + 2) + p[1]);
+    p = resizeBlock(idx, words, func);
+    if (e.data_type == BOOLEAN) {
+        bitRunsDecode(buf.data(), (u_int *)(p + 1), words);
+    } else {
+        lzDecode(buf.data(), (uint8_t *)(p + 1), words << 2);
+    }
+    e.raw_words = 0;
+    stats.compressed_arrays.fetch_sub(1, memory_order_relaxed);
+    stats.compression_bytes_saved.fetch_sub(saved, memory_order_relaxed);
+    statAdd(stats.decompressions, 1);
+    MEMORY("Decompressed array of entry %u to %lu word(s)", idx, words);
+}
+
+// Accounts for the freeing of entry idx if it is compressed. Called with the memory locked
+void compressionFree(u_int idx) {
+    PageTableEntry &e = page_table->pt[idx];
+    if (e.raw_words == 0) {
+        return;
+    }
+    stats.compressed_arrays.fetch_sub(1, memory_order_relaxed);
+    size_t words = (e.spill_words != 0) ? e.spill_words + 2 : *mem->getAddr(e.addr) >> 1;
+    stats.compression_bytes_saved.fetch_sub((e.raw_words + 2 - words) << 2, memory_order_relaxed);
+    e.raw_words = 0;
+}
+
+// Out-of-core tier: when an allocation finds no room even after compaction, cold arrays are moved to a backing file
+// mapped into memory, leaving a stub block of one word in the heap, and the next access faults them back in. The
+// victims are picked with CLOCK: every array access sets the PT_REFERENCED bit of its entry, and the hand going round
+// the page table clears the bits it passes and stops at the first array whose bit was already clear.
+const size_t MIN_SPILL_WORDS = 64;                  // smaller arrays are not worth spilling
+const size_t SPILL_MAP_FACTOR = 16;                 // the backing file holds up to this many times the memory
+const size_t SPILL_GROW_WORDS = (1 << 20) >> 2;     // the file grows 1 MB at a time
+
+int spill_fd = -1;
+int *spill_map;
+size_t spill_map_bytes;               // address space reserved for the backing file
+string spill_path;
+size_t spill_file_words;              // current size of the file
+size_t spill_end;                     // words of the file handed out so far
+map<size_t, size_t> spill_holes;      // offset -> words of the freed ranges below spill_end, coalesced
+pthread_mutex_t spill_mutex = PTHREAD_MUTEX_INITIALIZER;  // the shards share the file
+
+// Takes words from the backing file, first fit over the holes, and returns their offset or -1
+size_t spillAlloc(size_t words) {
+    LOCK(&spill_mutex);
+    for (auto it = spill_holes.begin(); it != spill_holes.end(); it++) {
+        if (it->second >= words) {
+            size_t off = it->first;
+            if (it->second > words) {
+                spill_holes[off + words] = it->second - words;
+            }
+            spill_holes.erase(it);
+            UNLOCK(&spill_mutex);
+            return off;
+        }
+    }
+    if (spill_end + words > spill_file_words) {
+        size_t grown = max(spill_end + words, spill_file_words + SPILL_GROW_WORDS);
+        if ((grown << 2) > spill_map_bytes || ftruncate(spill_fd, grown << 2) == -1) {
+            UNLOCK(&spill_mutex);
+            return (size_t)-1;
+        }
+        spill_file_words = grown;
+    }
+    size_t off = spill_end;
+    spill_end += words;
+    UNLOCK(&spill_mutex);
+    return off;
+}
+
+void spillRelease(size_t off, size_t words) {
+    LOCK(&spill_mutex);
+    auto next = spill_holes.lower_bound(off);
+    if (next != spill_holes.end() && next->first == off + words) {
+        words += next->second;
+        next = spill_holes.erase(next);
+    }
+    if (next != spill_holes.begin() && prev(next)->first + prev(next)->second == off) {
+        off = prev(next)->first;
+        words += prev(next)->second;
+        spill_holes.erase(prev(next));
+    }
+    if (off + words == spill_end) {
+        spill_end = off;
+    } else {
+        spill_holes[off] = words;
+    }
+    UNLOCK(&spill_mutex);
+}
+
+// Releases the backing file range of entry idx if it is spilled. Called with the memory locked
+void spillFree(u_int idx) {
+    PageTableEntry &e = page_table->pt[idx];
+    if (e.spill_words == 0) {
+        return;
+    }
+    spillRelease(e.spill_off, e.spill_words);
+    stats.spilled_arrays.fetch_sub(1, memory_order_relaxed);
+    stats.spill_bytes.fetch_sub(e.spill_words << 2, memory_order_relaxed);
+    e.spill_words = 0;
+}
+
+// Moves the array of entry idx to the backing file and shrinks its block to a stub. Called with the memory locked
+bool spillArr(u_int idx) {
+    PageTableEntry &e = page_table->pt[idx];
+    int *p = writableAddr(idx);  // a concurrent move would copy the block being given up
+    size_t words = (*p >> 1) - 2;
+    size_t off = spillAlloc(words);
+    if (off == (size_t)-1) {
+        return false;
+    }
+    memcpy(spill_map + off, p + 1, words << 2);
+    mem->shrinkBlock(p, 1);
+    e.spill_off = off;
+    e.spill_words = words;
+    siteResized(idx, words + 2);
+    statAdd(stats.spilled_arrays, 1);
+    statAdd(stats.spill_bytes, words << 2);
+    MEMORY("Spilled %lu word(s) of entry %u to the backing file at word %lu", words, idx, off);
+    return true;
+}
+
+// Brings the spilled array of entry idx back into the heap. Called with the memory locked, which is unlocked before
+// throwing
+void unspillArr(u_int idx, const char *func) {
+    PageTableEntry &e = page_table->pt[idx];
+    size_t words = e.spill_words;
+    int *p = resizeBlock(idx, words, func);
+    memcpy(p + 1, spill_map + e.spill_off, words << 2);
+    spillFree(idx);
+    statAdd(stats.spill_faults, 1);
+    MEMORY("Faulted %lu word(s) of entry %u back in from the backing file", words, idx);
+}
+
+// Advances the CLOCK hand of the selected shard to the next array that can be spilled and has not been referenced
+// since the hand last passed it. Returns its index, or -1 if there is none. Called with the memory locked
+int clockVictim(u_int keep) {
+    for (size_t n = 0; n < 2 * MAX_PT_ENTRIES; n++) {  // two rounds, the first one may only clear bits
+        u_int i = page_table->clock_hand;
+        page_table->clock_hand = (i + 1) % MAX_PT_ENTRIES;
+        PageTableEntry &e = page_table->pt[i];
+        u_int st = e.state.load(memory_order_acquire);
+        if (!(st & PT_VALID) || (st & PT_GARBAGE) || i == keep || e.spill_words != 0 || isShared(i) ||
+            (size_t)(*mem->getAddr(e.addr) >> 1) - 2 < MIN_SPILL_WORDS) {
+            continue;
+        }
+        if (st & PT_REFERENCED) {
+            e.state.fetch_and(~PT_REFERENCED, memory_order_relaxed);
+            continue;
+        }
+        return i;
+    }
+    return -1;
+}
+
+// Makes room for a block of sz words of data by spilling arrays other than entry keep, then compacting. Returns the
+// free block, or NULL if spilling is off or there is not enough to spill. Called with the memory locked
+int *spillForBlock(size_t sz, u_int keep) {
+    if (spill_fd < 0) {
+        return NULL;
+    }
+    while (mem->totalFree < sz + 2) {
+        int victim = clockVictim(keep);
+        if (victim < 0 || !spillArr(victim)) {
+            return NULL;
+        }
+    }
+    compactMemory();
+    return mem->findFreeBlock(sz);
+}
+
+void spillStart(string path) {
+    LIBRARY("spillStart called with path = %s", path.c_str());
+    if (shm_seg != NULL) {
+        throw runtime_error("spillStart: Shared memory cannot be spilled");
+    }
+    if (num_shards == 0) {
+        throw runtime_error("spillStart: Memory not created");
+    }
+    if (spill_fd >= 0) {
+        throw runtime_error("spillStart: Already spilling to " + spill_path);
+    }
+    size_t map_bytes = 0;
+    for (size_t s = 0; s < num_shards; s++) {
+        map_bytes += (shards[s].mem->size << 2) * SPILL_MAP_FACTOR;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        throw runtime_error("spillStart: Cannot open " + path);
+    }
+    void *addr = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        throw runtime_error("spillStart: mmap failed: " + string(strerror(errno)));
+    }
+    spill_map = (int *)addr;
+    spill_map_bytes = map_bytes;
+    spill_path = path;
+    spill_file_words = spill_end = 0;
+    spill_fd = fd;
+}
+
+// Data of the array of entry idx for readArr/assignArr, faulting it in and decompressing it first if needed. Called with the memory locked
+int *arrayData(u_int idx, bool write, const char *func) {
+    PageTableEntry &e = page_table->pt[idx];
+    e.last_use = nowMs();
+    if (!(e.state.load(memory_order_relaxed) & PT_REFERENCED)) {
+        e.state.fetch_or(PT_REFERENCED, memory_order_relaxed);
+    }
+    if (e.spill_words != 0) {
+        unspillArr(idx, func);
+    }
+    if (e.raw_words != 0) {
+        decompressArr(idx, func);
+    }
+    return (write ? writableAddr(idx) : mem->getAddr(e.addr)) + 1;
+}
+
+// Compresses the arrays of the selected shard that have not been used for idle_ms milliseconds. Called with the
+// memory locked
+void compressCold(size_t idle_ms) {
+    u_int now = nowMs();
+    for (u_int i = 0; i < MAX_PT_ENTRIES; i++) {
+        PageTableEntry &e = page_table->pt[i];
+        u_int st = e.state.load(memory_order_acquire);
+        if (!(st & PT_VALID) || (st & PT_GARBAGE) || e.raw_words != 0 || e.spill_words != 0 || (e.data_type != CHAR && e.data_type != BOOLEAN) ||
+            isShared(i) || (u_int)(now - e.last_use) < idle_ms || (size_t)(*mem->getAddr(e.addr) >> 1) - 2 < MIN_COMPRESS_WORDS) {
+            continue;
+        }
+        if (!compressArr(i)) {
+            e.last_use = now;  // not tried again for another idle_ms milliseconds
+        }
+    }
+}
+
+void setColdCompression(size_t idle_ms) {
+    LIBRARY("setColdCompression called with idle_ms = %lu", idle_ms);
+    cold_ms.store(idle_ms, memory_order_relaxed);
+}
+
+void unqueueGarbage(u_int idx);
+
+// Frees entry idx and returns the free block its memory ended up in, or NULL if the block is still used by clones
+int *freeElem(u_int idx) {
     GC("freeElem called for array index %d in page table", idx);
+    if (page_table->pt[idx].state.load(memory_order_relaxed) & PT_GARBAGE) {  // freed by the program before it was swept
+        unqueueGarbage(idx);
+    }
+    u_int addr = page_table->pt[idx].addr;  // read before the entry goes back on the free list
+    u_int data_type = page_table->pt[idx].data_type;
+    bool shared = isShared(idx);
+    siteFree(idx);
+    compressionFree(idx);
+    spillFree(idx);
     int ret = page_table->remove(idx);  // Remove the entry from the page table
     if (ret == -1) {
         throw runtime_error("freeElem: Invalid Index");
     }
-    mem->freeBlock(mem->getAddr(page_table->pt[idx].addr));  // Free the memory block
+    int *p = NULL;
+    if (shared) {
+        unlinkShared(idx);  // The block lives on for the other clones
+    } else {
+        p = mem->freeBlock(mem->getAddr(addr));  // Free the memory block
+    }
+    statAdd(stats.num_frees[data_type], 1);
+    return p;
 }
 
 void freeElem(MyType &var) {
     LIBRARY("freeElem called for variable with counter = %d", var.ind);
-    LOCK(&mem->mutex);
-    LOCK(&page_table->mutex);
-    if (page_table->pt[counterToIdx(var.ind)].valid) {
+    traceRecord(TRACE_FREE, var.data_type, var.ind);
+    selectShardOf(var.ind);
+    lockMem();
+    if (page_table->isValid(var.ind)) {
         freeElem(counterToIdx(var.ind));
     }
-    UNLOCK(&page_table->mutex);
     UNLOCK(&mem->mutex);
 }
 
+// Lazy sweeping: gcRun only queues the unreachable entries, their blocks are freed by the allocations that follow.
+// The queue is kept in order of address so that the entries nearest to the allocation cursor go first. An entry is
+// in the queue exactly while its PT_GARBAGE bit is set, so the queue never holds more than MAX_PT_ENTRIES. All of
+// these are called with the memory locked.
+
+// Takes entry idx out of the sweep queue
+void unqueueGarbage(u_int idx) {
+    for (size_t i = 0; i < page_table->num_garbage; i++) {
+        if (counterToIdx(page_table->garbage[i]) == idx) {
+            memmove(&page_table->garbage[i], &page_table->garbage[i + 1], (page_table->num_garbage - i - 1) * sizeof(u_int));
+            page_table->num_garbage--;
+            break;
+        }
+    }
+    page_table->pt[idx].state.fetch_and(~PT_GARBAGE, memory_order_relaxed);
+}
+
+// Position in the sweep queue of the first entry at or after the allocation cursor
+size_t sweepCursor() {
+    if (mem->policy != NEXT_FIT) {
+        return 0;  // first fit allocates from the start and best fit does not care
+    }
+    u_int cursor = mem->getOffset(mem->rover);
+    size_t lo = 0, hi = page_table->num_garbage;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (page_table->pt[counterToIdx(page_table->garbage[mid])].addr < cursor) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo == page_table->num_garbage) ? 0 : lo;
+}
+
+// Sweeps the entry at position i of the queue and returns the free block it ended up in, if any
+int *sweepAt(size_t i) {
+    u_int counter = page_table->garbage[i];
+    memmove(&page_table->garbage[i], &page_table->garbage[i + 1], (page_table->num_garbage - i - 1) * sizeof(u_int));
+    page_table->num_garbage--;
+    if (!page_table->isValid(counter)) {  // cannot happen, freeElem takes entries out of the queue
+        return NULL;
+    }
+    page_table->pt[counterToIdx(counter)].state.fetch_and(~PT_GARBAGE, memory_order_relaxed);
+    statAdd(stats.objects_swept, 1);
+    return freeElem(counterToIdx(counter));
+}
+
+// Sweeps up to n queued entries starting at the allocation cursor
+void sweep(size_t n) {
+    size_t i = sweepCursor();
+    while (n-- > 0 && page_table->num_garbage > 0) {
+        if (i >= page_table->num_garbage) {
+            i = 0;
+        }
+        sweepAt(i);
+    }
+}
+
+void sweepAll() {
+    while (page_table->num_garbage > 0) {
+        sweepAt(page_table->num_garbage - 1);
+    }
+}
+
+// Finds a free block for sz words on the allocation path. Every allocation pays for a few queued entries, and if
+// nothing fits more are swept, just until one of them leaves a large enough free block.
+int *findFreeBlockSweeping(size_t sz) {
+    sweep(LAZY_SWEEP_QUOTA);
+    int *p = mem->findFreeBlock(sz);
+    while (p == NULL && page_table->num_garbage > 0) {
+        int *q = sweepAt(sweepCursor());
+        if (q != NULL && (size_t)(*q >> 1) >= sz + 2) {
+            p = q;
+        }
+    }
+    return p;
+}
+
 // Calculates new offsets that will be used for compaction
 void calcNewOffsets() {
     int *p = mem->start;
@@ -386,7 +1859,7 @@ void calcNewOffsets() {
 // Updates the page table entries with the new offsets for compaction
 void updatePageTable() {
     for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
-        if (page_table->pt[i].valid) {
+        if (page_table->pt[i].valid()) {
             int *p = mem->getAddr(page_table->pt[i].addr);
             int newAddr = *(p + (*p >> 1) - 1) >> 1;
             PAGE_TABLE("Index: %ld, Old addr: %d, New addr: %d", i, page_table->pt[i].addr, newAddr);
@@ -396,7 +1869,109 @@ void updatePageTable() {
     GC("Page table updated for compaction");
 }
 
+CompactionMode compaction_mode = COMPACT_SLIDE;
+
+// Scratch buffer of every shard for hot first compaction, as large as its heap. It is mapped when COMPACT_HOT_FIRST is
+// selected, so that compaction never allocates, and its pages are given back after every use. Set and cleared with
+// the memory of the shard locked
+int *hot_scratch[MAX_SHARDS];
+
+// Maps the scratch buffers of the shards that do not have one yet, false if the memory cannot be reserved
+bool reserveHotScratch() {
+    for (size_t s = 0; s < num_shards; s++) {
+        if (hot_scratch[s] != NULL) {
+            continue;
+        }
+        void *addr = mmap(NULL, shards[s].mem->size << 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        selectShard(s);
+        lockMem();
+        hot_scratch[s] = (int *)addr;
+        UNLOCK(&mem->mutex);
+    }
+    return true;
+}
+
+void releaseHotScratch() {
+    for (size_t s = 0; s < num_shards; s++) {
+        selectShard(s);
+        lockMem();  // waits for a compaction that is using it
+        if (hot_scratch[s] != NULL) {
+            munmap(hot_scratch[s], mem->size << 2);
+            hot_scratch[s] = NULL;
+        }
+        UNLOCK(&mem->mutex);
+    }
+}
+
+// Compaction that lays out the live blocks hottest first instead of keeping their order: they are copied out to the
+// shard's scratch buffer in order of heat and back to the start of the heap. Returns false if this process has not
+// reserved the buffer (shared memory compacted on behalf of another process), in which case the blocks are slid
+// down as usual. Called with the memory locked
+bool packHotFirst() {
+    int *scratch = hot_scratch[page_table->shard];
+    if (scratch == NULL) {
+        return false;
+    }
+    unordered_map<u_int, u_int> heat;  // block offset -> heat of the entries using it, clones share a block
+    for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
+        if (page_table->pt[i].valid()) {
+            heat[page_table->pt[i].addr] += page_table->pt[i].heat.load(memory_order_relaxed);
+        }
+    }
+    vector<pair<u_int, u_int>> order;  // (heat, offset), sorted hottest first and by offset within the same heat
+    for (auto &h : heat) {
+        order.push_back({h.second, h.first});
+    }
+    sort(order.begin(), order.end(), [](const pair<u_int, u_int> &a, const pair<u_int, u_int> &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    GC("Starting hot first compaction of %lu blocks", order.size());
+    unordered_map<u_int, u_int> new_addr;
+    size_t off = 0;
+    for (auto &o : order) {
+        int *p = mem->getAddr(o.second);
+        size_t words = *p >> 1;
+        memcpy(scratch + off, p, words << 2);
+        new_addr[o.second] = off;
+        off += words;
+    }
+    memcpy(mem->start, scratch, off << 2);
+    madvise(scratch, off << 2, MADV_DONTNEED);  // keeps the mapping, so the next compaction gets the pages back
+    statAdd(stats.bytes_moved, off << 2);
+    if (off < mem->size) {  // everything after the live blocks is one free block
+        *(mem->start + off) = (mem->size - off) << 1;
+        *(mem->end - 1) = (mem->size - off) << 1;
+    }
+    for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
+        if (page_table->pt[i].valid()) {
+            page_table->pt[i].addr = new_addr[page_table->pt[i].addr];
+        }
+    }
+    mem->numFreeBlocks = (off < mem->size) ? 1 : 0;
+    mem->currMaxFree = mem->totalFree;
+    mem->rebuildIndex();
+    statAdd(stats.compactions, 1);
+    GC("Hot first compaction completed");
+    return true;
+}
+
 void compactMemory() {
+    sweepAll();  // queued garbage would otherwise be moved along with the live blocks
+    if (mem->move_idx != MAX_PT_ENTRIES) {  // the concurrent compactor's copy is given up, its target may move
+        mem->move_cancel.store(true, memory_order_relaxed);
+        while (mem->copying.load(memory_order_acquire)) {  // but not while it is still writing to the target, which it
+            sched_yield();                                 // stops doing after the chunk it is copying
+        }
+        page_table->pt[mem->move_idx].state.fetch_and(~PT_MOVING, memory_order_relaxed);
+        mem->freeBlock(mem->getAddr(mem->move_dst));
+        mem->move_idx = MAX_PT_ENTRIES;
+    }
+    if (compaction_mode == COMPACT_HOT_FIRST && packHotFirst()) {
+        return;
+    }
     GC("Before compaction:");
     mem->displayMem();
     GC("Starting memory compaction");
@@ -409,6 +1984,7 @@ void compactMemory() {
             int curr_size = *p >> 1;
             int next_size = *next >> 1;
             memcpy(p, next, next_size << 2);
+            statAdd(stats.bytes_moved, next_size << 2);
             p = p + next_size;
             *p = curr_size << 1;
             *(p + curr_size - 1) = curr_size << 1;
@@ -433,35 +2009,78 @@ void compactMemory() {
     GC("Block footers updated");
     mem->numFreeBlocks = 1;
     mem->currMaxFree = mem->totalFree;
+    mem->rebuildIndex();
+    statAdd(stats.compactions, 1);
     GC("Memory compaction completed");
     GC("After compaction:");
     mem->displayMem();
 }
 
-void gcRun() {
-    LOCK(&mem->mutex);
-    LOCK(&page_table->mutex);
-    GC("gcRun called");
-    // Perform mark and sweep
+atomic<bool> compactor_running(false);  // gcRun leaves compaction to the concurrent compactor while it runs
+
+// Collects the selected shard, the pause is the time its lock is held
+void gcRunShard() {
+    lockMem();
+    size_t pause_start = getTimeNs();
+    GC("gcRun called for shard %u", page_table->shard);
+    // Mark, the sweep is left to the allocations (see findFreeBlockSweeping)
+    size_t queued = page_table->num_garbage;
     for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
-        if (page_table->pt[i].valid && !page_table->pt[i].marked) {
-            freeElem(i);
+        u_int st = page_table->pt[i].state.load(memory_order_acquire);
+        if ((st & PT_VALID) && !(st & (PT_MARKED | PT_GARBAGE))) {
+            assert(page_table->num_garbage < MAX_PT_ENTRIES);  // every queued entry is a distinct valid one
+            page_table->pt[i].state.fetch_or(PT_GARBAGE, memory_order_acq_rel);
+            page_table->garbage[page_table->num_garbage++] = idxToCounter(i, (st >> PT_GEN_SHIFT) & GEN_MASK, page_table->shard);
         }
     }
+    if (page_table->num_garbage > queued) {
+        GC("Queued %lu unreachable entries for sweeping", page_table->num_garbage - queued);
+        sort(page_table->garbage, page_table->garbage + page_table->num_garbage,
+             [](u_int a, u_int b) { return page_table->pt[counterToIdx(a)].addr < page_table->pt[counterToIdx(b)].addr; });
+    }
+    size_t cold = cold_ms.load(memory_order_relaxed);
+    if (cold != 0) {
+        compressCold(cold);
+    }
     // Check if compaction needs to be done
     double ratio = (double)mem->totalFree / (double)(mem->currMaxFree + 1);
     GC("Ratio (Total Free/Largest Free) = %f", ratio);
-    if (ratio >= COMPACTION_RATIO_THRESHOLD) {
+    if (ratio >= COMPACTION_RATIO_THRESHOLD && !compactor_running.load(memory_order_relaxed)) {
         GC("Ratio more than compaction ratio threshold");
         compactMemory();
     }
-    GC("gcRun finished");
-    UNLOCK(&page_table->mutex);
+    size_t pause = getTimeNs() - pause_start;
+    statAdd(stats.gc_pause_total_ns, pause);
+    statMax(stats.gc_pause_max_ns, pause);
     UNLOCK(&mem->mutex);
 }
 
+// Serializes the GC thread's collections with the ones an allocation crossing the soft limit runs in its own thread,
+// so that every cycle is counted once and heat decays on schedule
+pthread_mutex_t gc_run_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void gcRun() {
+    LOCK(&gc_run_mutex);
+    for (size_t s = 0; s < num_shards; s++) {
+        selectShard(s);
+        gcRunShard();
+    }
+    if (statGet(stats.gc_cycles) % HEAT_DECAY_CYCLES == 0) {
+        for (size_t s = 0; s < num_shards; s++) {
+            for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
+                atomic<u_int> &heat = shards[s].page_table->pt[i].heat;
+                heat.store(heat.load(memory_order_relaxed) >> 1, memory_order_relaxed);
+            }
+        }
+    }
+    statAdd(stats.gc_cycles, 1);
+    UNLOCK(&gc_run_mutex);
+    GC("gcRun finished");
+}
+
 void gcActivate() {
     GC("gcActivate called");
+    traceRecord(TRACE_GC_ACTIVATE);
     if (gc_active) {
         pthread_kill(gc_tid, SIGUSR1);
     }
@@ -495,11 +2114,56 @@ void *gcThread(void *arg) {
     }
 }
 
+void releaseStack(void *arg);
+
+void stackKeyInit() {
+    pthread_key_create(&stack_key, releaseStack);
+}
+
+// Returns the scope stack of the calling thread, creating and registering it on first use
+Stack *getStack() {
+    if (var_stack == NULL) {
+        pthread_once(&stack_once, stackKeyInit);
+        var_stack = (Stack *)malloc(sizeof(Stack));
+        var_stack->init();
+        LOCK(&stacks_mutex);
+        var_stack->next = stacks;
+        stacks = var_stack;
+        UNLOCK(&stacks_mutex);
+        pthread_setspecific(stack_key, var_stack);
+    }
+    return var_stack;
+}
+
+// Called when a thread exits: its remaining variables go out of scope and its stack is unregistered
+void releaseStack(void *arg) {
+    Stack *st = (Stack *)arg;
+    while (st->size > 0) {
+        int ind = st->pop();
+        if (ind >= 0) {
+            shards[counterToShard(ind)].page_table->unmark(ind);
+        }
+    }
+    LOCK(&stacks_mutex);
+    Stack **pp = &stacks;
+    while (*pp != st) {
+        pp = &(*pp)->next;
+    }
+    *pp = st->next;
+    UNLOCK(&stacks_mutex);
+    free(st);
+    STACK("Released stack of exiting thread");
+}
+
 // Indicates that a new scope has been entered
 void initScope() {
     LIBRARY("initScope called");
+    if (num_shards == 0) {
+        throw runtime_error("initScope: Memory not created");
+    }
+    traceRecord(TRACE_INIT_SCOPE);
     if (gc_active) {
-        if (var_stack->push(-1) < 0) {
+        if (getStack()->push(-1) < 0) {
             throw runtime_error("initScope: Stack full, cannot push");
         }
     }
@@ -508,42 +2172,86 @@ void initScope() {
 // Indicates that the current scope has ended
 void endScope() {
     LIBRARY("endScope called");
+    if (num_shards == 0) {
+        throw runtime_error("endScope: Memory not created");
+    }
+    traceRecord(TRACE_END_SCOPE);
     if (gc_active) {
         int ind;
         do {
-            ind = var_stack->pop();
+            ind = getStack()->pop();
             if (ind == -2) {
                 throw runtime_error("endScope: Stack empty, cannot pop");
             }
             if (ind >= 0) {
-                LOCK(&page_table->mutex);
-                page_table->pt[counterToIdx(ind)].marked = 0;  // Set mark bit to 0
-                PAGE_TABLE("Unmarked entry in page table for variable with counter = %d", ind);
-                UNLOCK(&page_table->mutex);
+                shards[counterToShard(ind)].page_table->unmark(ind);  // Set mark bit to 0
             }
         } while (ind >= 0);
     }
 }
 
+// Leaves the shared memory segment, removing it if this is the last process attached. Called with the memory locked
+void detachSharedMem() {
+    size_t length = shm_seg->length;
+    if (--shm_seg->num_attached == 0) {
+        pthread_mutex_destroy(&mem->mutex);
+        shm_unlink(shm_name.c_str());
+        MEMORY("Last process detached, removed shared memory segment %s", shm_name.c_str());
+    } else {
+        UNLOCK(&mem->mutex);
+    }
+    munmap(shm_seg, length);
+    MEMORY("Detached from shared memory segment %s", shm_name.c_str());
+}
+
 // Function to exit by freeing up all resources
 void cleanExit() {
     LIBRARY("cleanExit called");
-    LOCK(&mem->mutex);
-    LOCK(&page_table->mutex);
+    compactorStop();  // before locking, the compactor may be waiting for a lock to commit a move
+    for (size_t s = 0; s < num_shards; s++) {  // so that the garbage collector is not cancelled halfway through a shard
+        selectShard(s);
+        lockMem();
+    }
     if (gc_active) {
         pthread_cancel(gc_tid);
     }
+    traceStop();
     sem_destroy(&gc_sem);
-    pthread_mutex_destroy(&mem->mutex);
-    pthread_mutex_destroy(&page_table->mutex);
-    free(var_stack);
-    STACK("Freed memory allotted to stack");
-    free(page_table);
-    PAGE_TABLE("Freed memory allotted to page table");
-    free(mem->start);
-    free(mem);
+    LOCK(&stacks_mutex);
+    while (stacks != NULL) {
+        Stack *st = stacks;
+        stacks = st->next;
+        free(st);
+    }
+    UNLOCK(&stacks_mutex);
+    STACK("Freed memory allotted to stacks");
+    if (shm_seg != NULL) {
+        detachSharedMem();
+        exit(0);
+    }
+    for (size_t s = 0; s < num_shards; s++) {
+        selectShard(s);
+        if (hot_scratch[s] != NULL) {
+            munmap(hot_scratch[s], mem->size << 2);
+        }
+        pthread_mutex_destroy(&mem->mutex);
+        free(page_table);
+        if (heap_map_len != 0) {
+            munmap(mem->start, heap_map_len);
+        } else {
+            free(mem->start);
+        }
+        delete mem->free_index;
+        free(mem);
+    }
+    PAGE_TABLE("Freed memory allotted to page tables");
+    if (spill_fd >= 0) {
+        munmap(spill_map, spill_map_bytes);
+        close(spill_fd);
+        unlink(spill_path.c_str());
+    }
     MEMORY("Freed main memory");
-    exit(0);
+    exit(0);  // the log buffers are flushed at exit
 }
 
 // Get word location for arrays using index in the array
@@ -570,23 +2278,37 @@ int idxToOffset(DataType type, int idx) {
     return (idx - word * cnt) * getSize(type);
 }
 
-void createMem(size_t bytes, bool is_gc_active, bool is_profiler_active, string file) {
-    LIBRARY("createMem called");
-    if (mem != NULL) {
+void initRuntime(bool is_gc_active, bool is_profiler_active, string file);
+
+void createMem(size_t bytes, bool is_gc_active, bool is_profiler_active, string file, PlacementPolicy policy, int n_shards) {
+    initLog();
+    LIBRARY("createMem called with %d shard(s)", n_shards);
+    if (num_shards != 0) {
         throw runtime_error("createMem: Memory already created");
     }
-    bytes = (size_t)(bytes * EXTRA_MEM_FACTOR);
+    if (n_shards < 1 || n_shards > (int)MAX_SHARDS) {
+        throw runtime_error("createMem: Number of shards should be between 1 and " + to_string(MAX_SHARDS));
+    }
+    mem_bytes = bytes;
+    bytes = (size_t)(bytes * EXTRA_MEM_FACTOR) / n_shards;
     bytes = ((bytes + 3) >> 2) << 2;
-    mem = (Memory *)malloc(sizeof(Memory));
-    if (mem->init(bytes) == -1) {
-        throw runtime_error("createMem: Memory allocation failed");
+    for (int s = 0; s < n_shards; s++) {
+        shards[s].mem = (Memory *)malloc(sizeof(Memory));
+        if (shards[s].mem->init(bytes, policy) == -1) {
+            throw runtime_error("createMem: Memory allocation failed");
+        }
+        shards[s].page_table = (PageTable *)malloc(sizeof(PageTable));
+        shards[s].page_table->init(s);
     }
+    num_shards = n_shards;
+    selectShard(0);
 
-    page_table = (PageTable *)malloc(sizeof(PageTable));
-    page_table->init();
+    initRuntime(is_gc_active, is_profiler_active, file);
+}
 
-    var_stack = (Stack *)malloc(sizeof(Stack));
-    var_stack->init();
+// Sets up the per process state: log thread, garbage collection thread, profiler and tracing
+void initRuntime(bool is_gc_active, bool is_profiler_active, string file) {
+    logStartThread();  // before the garbage collection thread, whose SIGUSR1 handler logs
 
     gc_active = is_gc_active;  // To switch on/off garbage collection
     profiler_active = is_profiler_active;
@@ -600,33 +2322,272 @@ void createMem(size_t bytes, bool is_gc_active, bool is_profiler_active, string
         pthread_create(&gc_tid, NULL, gcThread, NULL);
         sem_wait(&gc_sem);  // Wait till the signal handler is installed in the garbage collection thread
     }
+
+    if (compaction_mode == COMPACT_HOT_FIRST && !reserveHotScratch()) {  // selected before the memory was created
+        throw runtime_error("Cannot reserve a scratch buffer for hot first compaction");
+    }
+
+    const char *trace_file = getenv(TRACE_ENV);
+    if (trace_file != NULL) {
+        traceStart(trace_file);
+    }
 }
 
-MyType create(VarType var_type, DataType data_type, u_int len, u_int size_req) {
-    LOCK(&mem->mutex);
-    int *p = mem->findFreeBlock(size_req);
-    if (p == NULL) {
-        LOCK(&page_table->mutex);
-        MEMORY("Could not find free block, trying compaction");
-        compactMemory();
-        UNLOCK(&page_table->mutex);
-        p = mem->findFreeBlock(size_req);
-        if (p == NULL) {
-            throw runtime_error("create: No free block in memory");
+void createSharedMem(string name, size_t bytes, bool is_gc_active, PlacementPolicy policy) {
+    initLog();
+    LIBRARY("createSharedMem called with name = %s", name.c_str());
+    if (num_shards != 0) {
+        throw runtime_error("createSharedMem: Memory already created");
+    }
+    if (policy == BEST_FIT) {
+        throw runtime_error("createSharedMem: Best fit index cannot be shared between processes");
+    }
+    size_t heap_bytes = (((size_t)(bytes * EXTRA_MEM_FACTOR) + 3) >> 2) << 2;
+    size_t length = sizeof(SharedSegment) + heap_bytes;
+
+    bool creator = true;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        creator = false;
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (fd == -1) {
+        throw runtime_error("createSharedMem: shm_open failed: " + string(strerror(errno)));
+    }
+    if (creator) {
+        if (ftruncate(fd, length) == -1) {
+            close(fd);
+            shm_unlink(name.c_str());
+            throw runtime_error("createSharedMem: ftruncate failed: " + string(strerror(errno)));
+        }
+    } else {
+        struct stat st;
+        while (fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(SharedSegment)) {  // Wait till the creator sizes the segment
+            usleep(SHM_POLL_US);
+        }
+        length = st.st_size;
+    }
+    void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw runtime_error("createSharedMem: mmap failed: " + string(strerror(errno)));
+    }
+    SharedSegment *seg = (SharedSegment *)addr;
+
+    if (creator) {
+        memcpy(seg->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+        seg->num_attached = 0;
+        seg->length = length;
+        seg->bytes = bytes;
+        seg->mem.init(heap_bytes, policy, (int *)(seg + 1));
+        seg->page_table.init(0);
+        seg->ready.store(1, memory_order_release);
+        MEMORY("Created shared memory segment %s of %lu bytes", name.c_str(), length);
+    } else {
+        while (seg->ready.load(memory_order_acquire) == 0) {  // Wait till the creator initializes the segment
+            usleep(SHM_POLL_US);
+        }
+        if (memcmp(seg->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0) {
+            munmap(addr, length);
+            throw runtime_error("createSharedMem: " + name + " is not a memlab segment");
+        }
+        MEMORY("Attached to shared memory segment %s", name.c_str());
+    }
+
+    shm_seg = seg;
+    shm_name = name;
+    shards[0].mem = &seg->mem;
+    shards[0].page_table = &seg->page_table;
+    num_shards = 1;
+    selectShard(0);
+    mem_bytes = seg->bytes;
+    lockMem();
+    seg->num_attached++;
+    UNLOCK(&mem->mutex);
+
+    initRuntime(is_gc_active, false, "");
+}
+
+// Memory limits in words, 0 when off
+atomic<size_t> soft_limit(0);
+atomic<size_t> hard_limit(0);
+atomic<bool> soft_limit_crossed(false);  // so that a crossing collects and calls back once, not on every allocation
+vector<pair<void (*)(size_t, void *), void *>> soft_limit_callbacks;
+pthread_mutex_t limits_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const char *mem_status_str[] = {"OK", "Hard memory limit reached", "No free block in memory", "No free space in page table",
+                                "Stack full, cannot push"};
+
+// Allocated words over all shards, read without taking their locks
+size_t wordsUsed() {
+    size_t used = 0;
+    for (size_t s = 0; s < num_shards; s++) {
+        used += shards[s].mem->size - __atomic_load_n(&shards[s].mem->totalFree, __ATOMIC_RELAXED);
+    }
+    return used;
+}
+
+size_t limitWords(size_t bytes, const char *func) {
+    if (num_shards == 0) {
+        throw runtime_error(string(func) + ": Memory not created");
+    }
+    return (bytes + 3) >> 2;
+}
+
+size_t limitWordsFraction(double fraction, const char *func) {
+    if (fraction < 0 || fraction > 1) {
+        throw runtime_error(string(func) + ": Fraction should be between 0 and 1");
+    }
+    limitWords(0, func);  // throws if the memory is not created
+    size_t words = 0;
+    for (size_t s = 0; s < num_shards; s++) {
+        words += shards[s].mem->size;
+    }
+    return words * fraction;
+}
+
+void setSoftLimit(size_t bytes) {
+    LIBRARY("setSoftLimit called with %lu bytes", bytes);
+    soft_limit.store(limitWords(bytes, "setSoftLimit"), memory_order_relaxed);
+    soft_limit_crossed.store(false, memory_order_relaxed);
+}
+
+void setSoftLimitFraction(double fraction) {
+    LIBRARY("setSoftLimitFraction called with %f", fraction);
+    soft_limit.store(limitWordsFraction(fraction, "setSoftLimitFraction"), memory_order_relaxed);
+    soft_limit_crossed.store(false, memory_order_relaxed);
+}
+
+void setHardLimit(size_t bytes) {
+    LIBRARY("setHardLimit called with %lu bytes", bytes);
+    hard_limit.store(limitWords(bytes, "setHardLimit"), memory_order_relaxed);
+}
+
+void setHardLimitFraction(double fraction) {
+    LIBRARY("setHardLimitFraction called with %f", fraction);
+    hard_limit.store(limitWordsFraction(fraction, "setHardLimitFraction"), memory_order_relaxed);
+}
+
+void onSoftLimit(void (*callback)(size_t bytes_live, void *arg), void *arg) {
+    LOCK(&limits_mutex);
+    soft_limit_callbacks.push_back({callback, arg});
+    UNLOCK(&limits_mutex);
+}
+
+// Sweeps everything the collector has queued in every shard, after crossing the soft limit
+void sweepAllShards() {
+    for (size_t s = 0; s < num_shards; s++) {
+        selectShard(s);
+        lockMem();
+        sweepAll();
+        UNLOCK(&mem->mutex);
+    }
+}
+
+// True if words more allocated words stay within the hard limit. Fails fast, reclaiming memory is left to the soft limit
+bool withinHardLimit(size_t words) {
+    size_t hard = hard_limit.load(memory_order_relaxed);
+    return hard == 0 || wordsUsed() + words <= hard;
+}
+
+// Called after an allocation. On crossing the soft limit collects in the calling thread, sweeping right away instead
+// of leaving it to later allocations, and then calls the callbacks with the live bytes left.
+void checkSoftLimit() {
+    size_t soft = soft_limit.load(memory_order_relaxed);
+    if (soft == 0) {
+        return;
+    }
+    if (wordsUsed() <= soft) {
+        if (soft_limit_crossed.load(memory_order_relaxed)) {
+            soft_limit_crossed.store(false, memory_order_relaxed);
         }
+        return;
+    }
+    if (soft_limit_crossed.exchange(true)) {
+        return;
     }
-    mem->allocateBlock(p, size_req);
-    int addr = mem->getOffset(p);
-    LOCK(&page_table->mutex);
-    int idx = page_table->insert(addr);
-    if (idx < 0) {
-        throw runtime_error("create: No free space in page table");
+    GC("Soft limit crossed with %lu bytes live, collecting", wordsUsed() << 2);
+    if (gc_active) {  // without the collector nothing is ever unreachable
+        gcRun();
+        sweepAllShards();
+    }
+    size_t used = wordsUsed();
+    if (used <= soft) {  // rearm, the next crossing collects again
+        soft_limit_crossed.store(false, memory_order_relaxed);
+    }
+    LOCK(&limits_mutex);
+    auto callbacks = soft_limit_callbacks;
+    UNLOCK(&limits_mutex);
+    for (auto &cb : callbacks) {
+        cb.first(used << 2, cb.second);
+    }
+}
+
+// Allocates a variable or array and sets *ind to its counter. On failure *ind is left alone and nothing stays allocated
+MemStatus tryCreate(DataType data_type, u_int len, u_int size_req, void *pc, int *ind) {
+    if (gc_active && getStack()->size >= MAX_STACK_SIZE) {  // checked first so that nothing is left allocated
+        return MEM_STACK_FULL;
+    }
+    if (!withinHardLimit(size_req + 2)) {
+        MEMORY("Allocation of %u word(s) refused, hard limit reached", size_req + 2);
+        return MEM_HARD_LIMIT;
+    }
+    u_int home = homeShard();
+    MemStatus status = MEM_NO_SPACE;
+    int counter = -1;
+    for (size_t k = 0; k < num_shards; k++) {  // the home shard first, the others only if it is full
+        selectShard((home + k) % num_shards);
+        u_int idx;
+        if (page_table->reserve(1, &idx) < 0) {
+            status = MEM_PT_FULL;
+            continue;
+        }
+        lockMem();
+        int *p = findFreeBlockSweeping(size_req);
+        if (p == NULL) {
+            MEMORY("Could not find free block, trying compaction");
+            compactMemory();
+            p = mem->findFreeBlock(size_req);
+        }
+        if (p == NULL) {
+            p = spillForBlock(size_req, MAX_PT_ENTRIES);
+        }
+        if (p != NULL) {
+            mem->allocateBlock(p, size_req);
+            counter = page_table->fill(idx, mem->getOffset(p), data_type, len);
+            break;
+        }
+        UNLOCK(&mem->mutex);
+        page_table->release(idx);
+        status = MEM_NO_SPACE;
+    }
+    if (counter < 0) {
+        return status;
+    }
+    if (siteSample()) {
+        u_int site = siteLookup(pc);
+        if (site != NO_SITE) {
+            page_table->pt[counterToIdx(counter)].site = site;
+            page_table->pt[counterToIdx(counter)].birth = statGet(stats.gc_cycles);
+            statAdd(sites[site].allocs, 1);
+            statAdd(sites[site].live_bytes, (size_req + 2) << 2);
+        }
     }
-    UNLOCK(&page_table->mutex);
     UNLOCK(&mem->mutex);
-    u_int ind = idxToCounter(idx);
-    if (var_stack->push(ind) < 0) {
-        throw runtime_error("create: Stack full, cannot push");
+    statAdd(stats.num_allocs[data_type], 1);
+    if (gc_active) {  // the stack only tracks roots for the garbage collector, there is room as checked above
+        getStack()->push(counter);
+    }
+    *ind = counter;
+    checkSoftLimit();
+    return MEM_OK;
+}
+
+MyType create(VarType var_type, DataType data_type, u_int len, u_int size_req, void *pc) {
+    int ind;
+    MemStatus status = tryCreate(data_type, len, size_req, pc, &ind);
+    if (status != MEM_OK) {
+        throw runtime_error(string("create: ") + mem_status_str[status]);
     }
     return MyType(ind, var_type, data_type, len);
 }
@@ -634,7 +2595,20 @@ MyType create(VarType var_type, DataType data_type, u_int len, u_int size_req) {
 MyType createVar(DataType type) {
     LIBRARY("createVar called with type = %s", getDataTypeStr(type).c_str());
     WORD_ALIGN("Creating variable, so memory required = 1 word");
-    return create(PRIMITIVE, type, 1, 1);
+    MyType var = create(PRIMITIVE, type, 1, 1, __builtin_return_address(0));
+    traceRecord(TRACE_CREATE_VAR, type, var.ind, 1);
+    return var;
+}
+
+// On failure the handle has counter -1, which is never valid
+MemResult tryCreateVar(DataType type) {
+    LIBRARY("tryCreateVar called with type = %s", getDataTypeStr(type).c_str());
+    int ind = -1;
+    MemStatus status = tryCreate(type, 1, 1, __builtin_return_address(0), &ind);
+    if (status == MEM_OK) {
+        traceRecord(TRACE_CREATE_VAR, type, ind, 1);
+    }
+    return {status, MyType(ind, PRIMITIVE, type, 1)};
 }
 
 // Type checking
@@ -656,18 +2630,20 @@ void validate(MyType &var, VarType type, DataType d_type, bool index = false) {
     if (var.data_type != d_type) {
         throw runtime_error(func + "Type mismatch. Data type of variable is " + getDataTypeStr(var.data_type));
     }
-    if (!page_table->pt[counterToIdx(var.ind)].valid) {
+    selectShardOf(var.ind);
+    if (!page_table->isValid(var.ind)) {
         throw runtime_error(func + "Variable is not valid");
     }
+    recordAccess(var.ind);
 }
 
 // Assign an int
 void assignVar(MyType &var, int val) {
     LIBRARY("assignVar (int) called for variable with counter = %d and value = %d", var.ind, val);
     validate(var, PRIMITIVE, INT);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(var.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = writableAddr(idx) + 1;
     memcpy(p, &val, 4);
     WORD_ALIGN("Data type = %s, wrote 1 word to memory", getDataTypeStr(var.data_type).c_str());
     UNLOCK(&mem->mutex);
@@ -677,9 +2653,9 @@ void assignVar(MyType &var, int val) {
 void assignVar(MyType &var, medium_int val) {
     LIBRARY("assignVar (medium int) called for variable with counter = %d and value = %d", var.ind, val.medIntToInt());
     validate(var, PRIMITIVE, MEDIUM_INT);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(var.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = writableAddr(idx) + 1;
     int temp = val.medIntToInt();
     memcpy(p, &temp, 4);
     WORD_ALIGN("Data type = %s, wrote 1 word to memory", getDataTypeStr(var.data_type).c_str());
@@ -690,9 +2666,9 @@ void assignVar(MyType &var, medium_int val) {
 void assignVar(MyType &var, char val) {
     LIBRARY("assignVar (char) called for variable with counter = %d and value = %c", var.ind, val);
     validate(var, PRIMITIVE, CHAR);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(var.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = writableAddr(idx) + 1;
     int temp = (int)val;
     memcpy(p, &temp, 4);
     WORD_ALIGN("Data type = char, wrote 1 word (1 byte data + 3 byte padding) to memory");
@@ -703,9 +2679,9 @@ void assignVar(MyType &var, char val) {
 void assignVar(MyType &var, bool val) {
     LIBRARY("assignVar (bool) called for variable with counter = %d and value = %d", var.ind, val);
     validate(var, PRIMITIVE, BOOLEAN);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(var.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = writableAddr(idx) + 1;
     int temp = (int)val;
     memcpy(p, &temp, 4);
     WORD_ALIGN("Data type = boolean, wrote 1 word (1 bit data + 3 byte, 7 bit padding) to memory");
@@ -718,11 +2694,13 @@ void readVar(MyType &var, void *ptr) {
     if (var.var_type != PRIMITIVE) {
         throw runtime_error("readVar: Variable is not a primitive");
     }
-    if (!page_table->pt[counterToIdx(var.ind)].valid) {
+    selectShardOf(var.ind);
+    if (!page_table->isValid(var.ind)) {
         throw runtime_error("readVar: Variable is not valid");
     }
+    recordAccess(var.ind);
     int size = getSize(var.data_type);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(var.ind);
     int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
     int t = *(int *)p;
@@ -737,32 +2715,68 @@ void readVar(MyType &var, void *ptr) {
     UNLOCK(&mem->mutex);
 }
 
+// Number of words needed for an array
+u_int arrWords(DataType type, int len) {
+    if (type == INT || type == MEDIUM_INT) {
+        return len;  // 1 int/medium_int in 1 word
+    } else if (type == CHAR) {
+        return (len + 3) >> 2;  // 4 chars in one word
+    } else {
+        return (len + 31) >> 5;  // 32 booleans in one word
+    }
+}
+
 MyType createArr(DataType type, int len) {
     LIBRARY("createArr called with type = %s and len = %d", getDataTypeStr(type).c_str(), len);
     if (len <= 0) {
         throw runtime_error("createArr: Length of array should be greater than 0");
     }
-    u_int size_req;
-    if (type == INT || type == MEDIUM_INT) {
-        size_req = len;  // 1 int/medium_int in 1 word
-    } else if (type == CHAR) {
-        size_req = (len + 3) >> 2;  // 4 chars in one word
-    } else if (type == BOOLEAN) {
-        size_req = (len + 31) >> 5;  // 32 booleans in one word
-    }
+    u_int size_req = arrWords(type, len);
     WORD_ALIGN("Creating array of type = %s, len = %d, memory required = %d words", getDataTypeStr(type).c_str(), len, size_req);
-    return create(ARRAY, type, len, size_req);
+    MyType arr = create(ARRAY, type, len, size_req, __builtin_return_address(0));
+    traceRecord(TRACE_CREATE_ARR, type, arr.ind, len);
+    return arr;
+}
+
+MemResult tryCreateArr(DataType type, int len) {
+    LIBRARY("tryCreateArr called with type = %s and len = %d", getDataTypeStr(type).c_str(), len);
+    if (len <= 0) {
+        throw runtime_error("tryCreateArr: Length of array should be greater than 0");
+    }
+    int ind = -1;
+    MemStatus status = tryCreate(type, len, arrWords(type, len), __builtin_return_address(0), &ind);
+    if (status == MEM_OK) {
+        traceRecord(TRACE_CREATE_ARR, type, ind, len);
+    }
+    return {status, MyType(ind, ARRAY, type, len)};
+}
+
+// Length of the array as the page table records it, which resizeArr through another copy of the handle may have
+// changed. Whole-array copies stop at the shorter of it and arr.len, so neither the block nor the caller's buffer is
+// overrun. Called with the memory locked
+size_t arrLen(MyType &arr) {
+    return min(arr.len, (size_t)page_table->pt[counterToIdx(arr.ind)].len);
+}
+
+// Throws if index is outside the array as the page table records it. Called with the memory locked, which is
+// released before throwing
+void checkIndex(MyType &arr, int index, const char *func) {
+    if (index < 0 || (size_t)index >= page_table->pt[counterToIdx(arr.ind)].len) {
+        UNLOCK(&mem->mutex);
+        throw runtime_error(string(func) + ": Index out of range");
+    }
 }
 
 // Assign an entire array of ints
 void assignArr(MyType &arr, int val[]) {
     LIBRARY("assignArr (int) called for array with counter = %d", arr.ind);
     validate(arr, ARRAY, INT);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    size_t len = arrLen(arr);
+    int *p = arrayData(idx, true, "assignArr");
     WORD_ALIGN("Data type = %s, writing 1 word chunks to memory", getDataTypeStr(arr.data_type).c_str());
-    for (size_t i = 0; i < arr.len; i++) {
+    for (size_t i = 0; i < len; i++) {
         memcpy(p + i, &val[i], 4);
     }
     UNLOCK(&mem->mutex);
@@ -772,11 +2786,12 @@ void assignArr(MyType &arr, int val[]) {
 void assignArr(MyType &arr, medium_int val[]) {
     LIBRARY("assignArr (medium int) called for array with counter = %d", arr.ind);
     validate(arr, ARRAY, MEDIUM_INT);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    size_t len = arrLen(arr);
+    int *p = arrayData(idx, true, "assignArr");
     WORD_ALIGN("Data type = %s, writing 1 word chunks to memory", getDataTypeStr(arr.data_type).c_str());
-    for (size_t i = 0; i < arr.len; i++) {
+    for (size_t i = 0; i < len; i++) {
         int temp = val[i].medIntToInt();
         memcpy(p + i, &temp, 4);
     }
@@ -787,15 +2802,16 @@ void assignArr(MyType &arr, medium_int val[]) {
 void assignArr(MyType &arr, char val[]) {
     LIBRARY("assignArr (char) called for array with counter = %d", arr.ind);
     validate(arr, ARRAY, CHAR);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    size_t len = arrLen(arr);
+    int *p = arrayData(idx, true, "assignArr");
     WORD_ALIGN("Data type = char, writing 4 array elements into 1 word in memory");
-    for (size_t i = 0; i < arr.len; i += 4) {
+    for (size_t i = 0; i < len; i += 4) {
         u_int temp = 0;
         for (size_t j = 0; j < 4; j++) {
-            char c = (i + j < arr.len) ? val[i + j] : 0;
-            temp = temp | ((u_int)c << (j * 8));
+            char c = (i + j < len) ? val[i + j] : 0;
+            temp = temp | ((u_int)(unsigned char)c << (j * 8));
         }
         memcpy((char *)p + i, &temp, 4);
     }
@@ -806,14 +2822,15 @@ void assignArr(MyType &arr, char val[]) {
 void assignArr(MyType &arr, bool val[]) {
     LIBRARY("assignArr (bool) called for array with counter = %d", arr.ind);
     validate(arr, ARRAY, BOOLEAN);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    size_t len = arrLen(arr);
+    int *p = arrayData(idx, true, "assignArr");
     WORD_ALIGN("Data type = boolean, writing 32 array elements into 1 word in memory");
-    for (size_t i = 0; i < arr.len; i += 4) {
+    for (size_t i = 0; i * 8 < len; i += 4) {  // i is the byte offset, 8 elements to a byte
         u_int temp = 0;
         for (size_t j = 0; j < 32; j++) {
-            bool c = (i * 8 + j < arr.len) ? val[i * 8 + j] : false;
+            bool c = (i * 8 + j < len) ? val[i * 8 + j] : false;
             temp = temp | ((u_int)c << j);
         }
         memcpy((char *)p + i, &temp, 4);
@@ -825,12 +2842,10 @@ void assignArr(MyType &arr, bool val[]) {
 void assignArr(MyType &arr, int index, int val) {
     LIBRARY("assignArr (int[], index) called for array with counter = %d at index = %d and value = %d", arr.ind, index, val);
     validate(arr, ARRAY, INT, true);
-    if (index < 0 || index >= (int)arr.len) {
-        throw runtime_error("assignArr (int[], index): Index out of range");
-    }
-    LOCK(&mem->mutex);
+    lockMem();
+    checkIndex(arr, index, "assignArr (int[], index)");
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = arrayData(idx, true, "assignArr");
     WORD_ALIGN("Data type = %s, reading 1 word from memory", getDataTypeStr(arr.data_type).c_str());
     memcpy(p + index, &val, 4);
     UNLOCK(&mem->mutex);
@@ -840,12 +2855,10 @@ void assignArr(MyType &arr, int index, int val) {
 void assignArr(MyType &arr, int index, medium_int val) {
     LIBRARY("assignArr (medium int[], index) called for array with counter = %d at index = %d and value = %d", arr.ind, index, val.medIntToInt());
     validate(arr, ARRAY, MEDIUM_INT, true);
-    if (index < 0 || index >= (int)arr.len) {
-        throw runtime_error("assignArr (medium int[], index): Index out of range");
-    }
-    LOCK(&mem->mutex);
+    lockMem();
+    checkIndex(arr, index, "assignArr (medium int[], index)");
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = arrayData(idx, true, "assignArr");
     WORD_ALIGN("Data type = %s, reading 1 word from memory", getDataTypeStr(arr.data_type).c_str());
     int temp = val.medIntToInt();
     memcpy(p + index, &temp, 4);
@@ -856,12 +2869,10 @@ void assignArr(MyType &arr, int index, medium_int val) {
 void assignArr(MyType &arr, int index, char val) {
     LIBRARY("assignArr (char[], index) called for array with counter = %d at index = %d and value = %c", arr.ind, index, val);
     validate(arr, ARRAY, CHAR, true);
-    if (index < 0 || index >= (int)arr.len) {
-        throw runtime_error("assignArr (char[], index): Index out of range");
-    }
-    LOCK(&mem->mutex);
+    lockMem();
+    checkIndex(arr, index, "assignArr (char[], index)");
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = arrayData(idx, true, "assignArr");
     int *q = p + idxToWord(arr.data_type, index);
     int offset = idxToOffset(arr.data_type, index);
     WORD_ALIGN("Data type = char, reading entire 1 word memory");
@@ -878,12 +2889,10 @@ void assignArr(MyType &arr, int index, char val) {
 void assignArr(MyType &arr, int index, bool val) {
     LIBRARY("assignArr (bool[], index) called for array with counter = %d at index = %d and value = %d", arr.ind, index, val);
     validate(arr, ARRAY, BOOLEAN, true);
-    if (index < 0 || index >= (int)arr.len) {
-        throw runtime_error("assignArr (bool[], index): Index out of range");
-    }
-    LOCK(&mem->mutex);
+    lockMem();
+    checkIndex(arr, index, "assignArr (bool[], index)");
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = arrayData(idx, true, "assignArr");
     int *q = p + idxToWord(arr.data_type, index);
     int offset = idxToOffset(arr.data_type, index);
     WORD_ALIGN("Data type = char, reading entire 1 word memory");
@@ -902,32 +2911,35 @@ void readArr(MyType &arr, void *ptr) {
     if (arr.var_type != ARRAY) {
         throw runtime_error("readArr: Variable is not a array");
     }
-    if (!page_table->pt[counterToIdx(arr.ind)].valid) {
+    selectShardOf(arr.ind);
+    if (!page_table->isValid(arr.ind)) {
         throw runtime_error("readArr: Variable is not valid");
     }
+    recordAccess(arr.ind);
     int size = getSize(arr.data_type);
-    LOCK(&mem->mutex);
+    lockMem();
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    size_t len = arrLen(arr);
+    int *p = arrayData(idx, false, "readArr");
     if (arr.data_type == INT) {
         WORD_ALIGN("Data type = int, copying 1 word chunks from memory to the destination address");
-        for (size_t i = 0; i < arr.len; i++) {
+        for (size_t i = 0; i < len; i++) {
             memcpy((int *)ptr + i, p + i, size);
         }
     } else if (arr.data_type == MEDIUM_INT) {
         WORD_ALIGN("Data type = medium int, copying 1 word chunks from memory to the destination address");
-        for (size_t i = 0; i < arr.len; i++) {
+        for (size_t i = 0; i < len; i++) {
             int temp = *(p + i);
             medium_int t(temp);
             memcpy((medium_int *)ptr + i, &t, size);
         }
     } else if (arr.data_type == CHAR) {
         WORD_ALIGN("Data type = char, copying 1 word chunks (= 4 array elements) from memory to the destination address");
-        size_t blocks = (arr.len + 3) >> 2;
+        size_t blocks = (len + 3) >> 2;
         for (size_t i = 0; i < blocks; i++) {
             u_int temp = *(p + i);
             for (size_t j = 0; j < 4; j++) {
-                if (i * 4 + j < arr.len) {
+                if (i * 4 + j < len) {
                     memcpy((char *)ptr + (i * 4 + j), &temp, 1);
                     temp = temp >> 8;
                 }
@@ -935,11 +2947,11 @@ void readArr(MyType &arr, void *ptr) {
         }
     } else if (arr.data_type == BOOLEAN) {
         WORD_ALIGN("Data type = boolean, copying 1 word chunks (= 32 array elements) from memory to the destination address");
-        size_t blocks = (((arr.len + 31) >> 5) << 5) >> 4;
+        size_t blocks = (((len + 31) >> 5) << 5) >> 4;
         for (size_t i = 0; i < blocks; i++) {
             u_int temp = *(p + i);
             for (size_t j = 0; j < 32; j++) {
-                if (i * 32 + j < arr.len) {
+                if (i * 32 + j < len) {
                     *((bool *)ptr + i * 32 + j) = (temp & (1 << j)) != 0;
                 }
             }
@@ -954,16 +2966,16 @@ void readArr(MyType &arr, int index, void *ptr) {
     if (arr.var_type != ARRAY) {
         throw runtime_error("readArr (index): Variable is not a array");
     }
-    if (!page_table->pt[counterToIdx(arr.ind)].valid) {
+    selectShardOf(arr.ind);
+    if (!page_table->isValid(arr.ind)) {
         throw runtime_error("readArr (index): Variable is not valid");
     }
-    if (index < 0 || index >= (int)arr.len) {
-        throw runtime_error("readArr (index): Index out of range");
-    }
+    recordAccess(arr.ind);
     int size = getSize(arr.data_type);
-    LOCK(&mem->mutex);
+    lockMem();
+    checkIndex(arr, index, "readArr (index)");
     u_int idx = counterToIdx(arr.ind);
-    int *p = mem->getAddr(page_table->pt[idx].addr) + 1;
+    int *p = arrayData(idx, false, "readArr");
     int *q = p + idxToWord(arr.data_type, index);
     int offset = idxToOffset(arr.data_type, index);
     int t = *q;
@@ -987,3 +2999,599 @@ void readArr(MyType &arr, int index, void *ptr) {
     }
     UNLOCK(&mem->mutex);
 }
+
+// Returns a snapshot of the allocator and garbage collector statistics
+MemStats getMemStats() {
+    if (num_shards == 0) {
+        throw runtime_error("getMemStats: Memory not created");
+    }
+    MemStats ms;
+    for (int i = 0; i < 4; i++) {
+        ms.num_allocs[i] = statGet(stats.num_allocs[i]);
+        ms.num_frees[i] = statGet(stats.num_frees[i]);
+    }
+    ms.gc_cycles = statGet(stats.gc_cycles);
+    ms.objects_swept = statGet(stats.objects_swept);
+    ms.compactions = statGet(stats.compactions);
+    ms.bytes_moved = statGet(stats.bytes_moved);
+    ms.cow_copies = statGet(stats.cow_copies);
+    ms.moves = statGet(stats.moves);
+    ms.moves_aborted = statGet(stats.moves_aborted);
+    ms.compressed_arrays = statGet(stats.compressed_arrays);
+    ms.compression_bytes_saved = statGet(stats.compression_bytes_saved);
+    ms.decompressions = statGet(stats.decompressions);
+    ms.spilled_arrays = statGet(stats.spilled_arrays);
+    ms.spill_bytes = statGet(stats.spill_bytes);
+    ms.spill_faults = statGet(stats.spill_faults);
+    ms.gc_pause_total_ns = statGet(stats.gc_pause_total_ns);
+    ms.gc_pause_max_ns = statGet(stats.gc_pause_max_ns);
+
+    ms.bytes_live = ms.bytes_free = ms.bytes_live_peak = ms.num_free_blocks = ms.largest_free_block = 0;
+    ms.pt_used = ms.pt_capacity = ms.pending_sweep = 0;
+    for (size_t s = 0; s < num_shards; s++) {  // the peak is the sum of the peaks of the shards
+        selectShard(s);
+        lockMem();
+        ms.bytes_live += (mem->size - mem->totalFree) << 2;
+        ms.bytes_free += mem->totalFree << 2;
+        ms.bytes_live_peak += mem->peakUsed << 2;
+        ms.num_free_blocks += mem->numFreeBlocks;
+        ms.largest_free_block = max(ms.largest_free_block, mem->largestFreeBlock() << 2);
+        ms.pt_used += page_table->size.load(memory_order_relaxed);
+        ms.pt_capacity += MAX_PT_ENTRIES;
+        ms.pending_sweep += page_table->num_garbage;
+        UNLOCK(&mem->mutex);
+    }
+    return ms;
+}
+
+// Returns a copy-on-write clone of an array: a new page table entry for the same block. The first assignArr through
+// either handle gives that handle a private copy; the block is freed when the last handle sharing it is freed.
+MyType cloneArr(MyType &arr) {
+    LIBRARY("cloneArr called for array with counter = %d", arr.ind);
+    if (arr.var_type != ARRAY) {
+        throw runtime_error("cloneArr: Variable is not a array");
+    }
+    u_int idx = counterToIdx(arr.ind);
+    selectShardOf(arr.ind);
+    u_int clone_idx;
+    if (page_table->reserve(1, &clone_idx) < 0) {
+        throw runtime_error("cloneArr: No free space in page table");
+    }
+    lockMem();
+    if (!page_table->isValid(arr.ind)) {
+        UNLOCK(&mem->mutex);
+        page_table->release(clone_idx);
+        throw runtime_error("cloneArr: Variable is not valid");
+    }
+    try {
+        arrayData(idx, false, "cloneArr");  // clones share the uncompressed block
+    } catch (...) {  // the memory has been unlocked
+        page_table->release(clone_idx);
+        throw;
+    }
+    size_t len = page_table->pt[idx].len;
+    int ind = page_table->fill(clone_idx, page_table->pt[idx].addr, arr.data_type, len);
+    abortMove(idx, "Clone");  // the move would leave the clone on the freed block
+    page_table->pt[clone_idx].share_next = page_table->pt[idx].share_next;
+    page_table->pt[idx].share_next = clone_idx;
+    UNLOCK(&mem->mutex);
+    statAdd(stats.num_allocs[arr.data_type], 1);
+    if (gc_active && getStack()->push(ind) < 0) {
+        throw runtime_error("cloneArr: Stack full, cannot push");
+    }
+    traceRecord(TRACE_CLONE_ARR, arr.data_type, ind, arr.ind);
+    return MyType(ind, ARRAY, arr.data_type, len);
+}
+
+// Changes the length of an array, in place where possible (see resizeBlock). The counter stays the same, so the array keeps its place in its scope. Runs with the memory locked, so compaction
+// cannot move the block meanwhile. Returns the handle with the new length; the page table records it, so accesses
+// through older copies of the handle are checked against it too.
+MyType resizeArr(MyType &arr, int len) {
+    LIBRARY("resizeArr called for array with counter = %d and len = %d", arr.ind, len);
+    if (arr.var_type != ARRAY) {
+        throw runtime_error("resizeArr: Variable is not a array");
+    }
+    if (len <= 0) {
+        throw runtime_error("resizeArr: Length of array should be greater than 0");
+    }
+    u_int idx = counterToIdx(arr.ind);
+    size_t new_words = arrWords(arr.data_type, len);
+    selectShardOf(arr.ind);
+    lockMem();
+    if (!page_table->isValid(arr.ind)) {
+        UNLOCK(&mem->mutex);
+        throw runtime_error("resizeArr: Variable is not valid");
+    }
+    arrayData(idx, false, "resizeArr");  // decompresses it
+    resizeBlock(idx, new_words, "resizeArr");
+    page_table->pt[idx].len = len;
+    UNLOCK(&mem->mutex);
+    traceRecord(TRACE_RESIZE_ARR, arr.data_type, arr.ind, len);
+    return MyType(arr.ind, ARRAY, arr.data_type, len);
+}
+
+// Creates n variables/arrays at once: one update of the page table free list, one search for a free block that holds
+// all of them and one push onto the stack. If no block is large enough they are placed one by one, and if that
+// fails too the memory is compacted so that they fit in the single free block left. On failure out stays empty and
+// nothing stays allocated.
+MemStatus tryCreateBatch(const AllocSpec *specs, int n, vector<MyType> &out) {
+    LIBRARY("tryCreateBatch called for %d variables", n);
+    out.clear();
+    if (n <= 0) {
+        return MEM_OK;
+    }
+    vector<u_int> sizes(n), addrs(n), lens(n), idxs(n);
+    vector<DataType> types(n);
+    vector<int> counters(n);
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        if (specs[i].var_type == ARRAY && specs[i].len <= 0) {
+            throw runtime_error("tryCreateBatch: Length of array should be greater than 0");
+        }
+        sizes[i] = (specs[i].var_type == PRIMITIVE) ? 1 : arrWords(specs[i].data_type, specs[i].len);
+        types[i] = specs[i].data_type;
+        lens[i] = (specs[i].var_type == PRIMITIVE) ? 1 : specs[i].len;
+        total += sizes[i] + 2;
+    }
+    if (gc_active && getStack()->size + n > MAX_STACK_SIZE) {
+        return MEM_STACK_FULL;
+    }
+    if (!withinHardLimit(total)) {
+        MEMORY("Batch of %lu word(s) refused, hard limit reached", total);
+        return MEM_HARD_LIMIT;
+    }
+
+    selectShard(homeShard());  // the batch is placed in the home shard only
+    if (page_table->reserve(n, idxs.data()) < 0) {
+        return MEM_PT_FULL;
+    }
+    lockMem();
+    int *p = findFreeBlockSweeping(total - 2);
+    if (p == NULL && total > mem->totalFree) {
+        UNLOCK(&mem->mutex);
+        for (int i = 0; i < n; i++) {
+            page_table->release(idxs[i]);
+        }
+        return MEM_NO_SPACE;
+    }
+    if (p == NULL) {
+        MEMORY("No single free block for the batch, placing blocks one by one");
+        int placed = 0;
+        for (; placed < n; placed++) {
+            int *q = mem->findFreeBlock(sizes[placed]);
+            if (q == NULL) {
+                break;
+            }
+            mem->allocateBlock(q, sizes[placed]);
+            addrs[placed] = mem->getOffset(q);
+        }
+        if (placed < n) {  // Undo, after compaction all the free memory is one block that holds the whole batch
+            for (int i = 0; i < placed; i++) {
+                mem->freeBlock(mem->getAddr(addrs[i]));
+            }
+            MEMORY("Could not place the batch, trying compaction");
+            compactMemory();
+            p = mem->findFreeBlock(total - 2);
+        }
+    }
+    if (p != NULL) {
+        mem->allocateBlocks(p, sizes.data(), n, addrs.data());
+    }
+    for (int i = 0; i < n; i++) {
+        counters[i] = page_table->fill(idxs[i], addrs[i], types[i], lens[i]);
+    }
+    UNLOCK(&mem->mutex);
+
+    if (gc_active) {
+        getStack()->pushBatch(counters.data(), n);
+    }
+    out.reserve(n);
+    for (int i = 0; i < n; i++) {
+        statAdd(stats.num_allocs[types[i]], 1);
+        out.push_back(MyType(counters[i], specs[i].var_type, types[i], lens[i]));
+        traceRecord(specs[i].var_type == PRIMITIVE ? TRACE_CREATE_VAR : TRACE_CREATE_ARR, types[i], counters[i], lens[i]);
+    }
+    checkSoftLimit();
+    return MEM_OK;
+}
+
+vector<MyType> createBatch(const AllocSpec *specs, int n) {
+    LIBRARY("createBatch called for %d variables", n);
+    vector<MyType> out;
+    MemStatus status = tryCreateBatch(specs, n, out);
+    if (status != MEM_OK) {
+        throw runtime_error(string("createBatch: ") + mem_status_str[status]);
+    }
+    return out;
+}
+
+// Builds the heap snapshot JSON: a histogram of free block sizes in power-of-two buckets, a bitmap with one bit per
+// resolution bytes that is set if any of them is allocated, and the live bytes per data type. The page table gives
+// the type at each address, after which the heap is walked once.
+string heapSnapshotJson(size_t resolution) {
+    size_t res_words = max((size_t)1, (resolution + 3) >> 2);
+    size_t hist_blocks[64] = {0}, hist_bytes[64] = {0}, live_bytes[4] = {0};
+    size_t heap_bytes = 0, free_bytes = 0, chunks = 0;
+    vector<unsigned char> bitmap;
+    for (size_t s = 0; s < num_shards; s++) {  // the chunks of the shards follow each other in the bitmap
+        selectShard(s);
+        lockMem();
+        vector<pair<u_int, u_int>> types;  // block offset, data type
+        for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
+            if (page_table->pt[i].valid()) {
+                types.push_back({page_table->pt[i].addr, page_table->pt[i].data_type});
+            }
+        }
+        sort(types.begin(), types.end());
+
+        size_t base = chunks;
+        chunks += (mem->size + res_words - 1) / res_words;
+        bitmap.resize((chunks + 7) / 8, 0);
+        size_t t = 0;
+        for (int *p = mem->start; p < mem->end; p += *p >> 1) {
+            size_t words = *p >> 1;
+            if ((*p & 1) == 0) {
+                int b = 63 - __builtin_clzl(words << 2);
+                hist_blocks[b]++;
+                hist_bytes[b] += words << 2;
+                continue;
+            }
+            size_t off = p - mem->start;
+            while (t < types.size() && types[t].first < off) {
+                t++;
+            }
+            if (t < types.size() && types[t].first == off) {  // clones share the block, count it once
+                live_bytes[types[t].second] += words << 2;
+            }
+            for (size_t c = base + off / res_words; c <= base + (off + words - 1) / res_words; c++) {
+                bitmap[c >> 3] |= 1 << (c & 7);
+            }
+        }
+        heap_bytes += mem->size << 2;
+        free_bytes += mem->totalFree << 2;
+        UNLOCK(&mem->mutex);
+    }
+
+    string json = "{\"heap_bytes\": " + to_string(heap_bytes) + ", \"free_bytes\": " + to_string(free_bytes);
+    json += ", \"free_histogram\": [";
+    bool first = true;
+    for (int b = 0; b < 64; b++) {
+        if (hist_blocks[b] != 0) {
+            json += string(first ? "" : ", ") + "{\"min_bytes\": " + to_string(1ul << b) + ", \"blocks\": " + to_string(hist_blocks[b]) +
+                    ", \"bytes\": " + to_string(hist_bytes[b]) + "}";
+            first = false;
+        }
+    }
+    json += "], \"occupancy\": {\"resolution\": " + to_string(res_words << 2) + ", \"chunks\": " + to_string(chunks) + ", \"bitmap\": \"";
+    const char hex[] = "0123456789abcdef";
+    for (unsigned char byte : bitmap) {  // chunk i is bit i % 8 of byte i / 8
+        json += hex[byte >> 4];
+        json += hex[byte & 15];
+    }
+    json += "\"}, \"live_bytes\": {";
+    for (int i = 0; i < 4; i++) {
+        json += string(i ? ", " : "") + "\"" + getDataTypeStr((DataType)i) + "\": " + to_string(live_bytes[i]);
+    }
+    json += "}}\n";
+    return json;
+}
+
+void heapSnapshot(string file, size_t resolution) {
+    LIBRARY("heapSnapshot called with file = %s", file.c_str());
+    string json = heapSnapshotJson(resolution);
+    FILE *f = fopen(file.c_str(), "w");
+    if (f == NULL) {
+        throw runtime_error("heapSnapshot: Cannot open " + file);
+    }
+    fputs(json.c_str(), f);
+    fclose(f);
+}
+
+void heapSnapshot(void (*callback)(const string &json), size_t resolution) {
+    LIBRARY("heapSnapshot called with a callback");
+    callback(heapSnapshotJson(resolution));
+}
+
+// Heap files written by saveHeap: a HeapFileHeader, the page table, and the heap at a page aligned offset so that it
+// can be mapped. Only the live blocks at the front of the compacted heap and the header and footer of the free block
+// after them are written, the rest of the file is a hole.
+#define HEAP_FILE_MAGIC "MLHEAP1"
+#define HEAP_FILE_VERSION 1
+
+struct HeapFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t policy;
+    uint64_t bytes;       // as passed to createMem
+    uint64_t heap_words;  // size of the heap
+    uint64_t used_words;  // words of live blocks at the start of the heap
+    uint64_t heap_offset;
+    uint64_t checksum;  // FNV-1a over this header with checksum 0, the page table and the live blocks
+};
+
+uint64_t fnv1a(const void *data, size_t len, uint64_t h = 14695981039346656037ull) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t heapFileChecksum(HeapFileHeader hdr, const PageTable *pt, const int *heap) {
+    hdr.checksum = 0;
+    return fnv1a(heap, hdr.used_words << 2, fnv1a(pt, sizeof(PageTable), fnv1a(&hdr, sizeof(hdr))));
+}
+
+bool writeFull(int fd, const void *buf, size_t len, off_t off) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+void saveHeap(string path) {
+    LIBRARY("saveHeap called with path = %s", path.c_str());
+    if (num_shards == 0) {
+        throw runtime_error("saveHeap: Memory not created");
+    }
+    if (num_shards > 1) {
+        throw runtime_error("saveHeap: Sharded memory cannot be saved");
+    }
+    if (spill_fd >= 0) {
+        throw runtime_error("saveHeap: Memory that spills to a file cannot be saved");
+    }
+    selectShard(0);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        throw runtime_error("saveHeap: Cannot open " + path);
+    }
+    PageTable *pt_copy = (PageTable *)malloc(sizeof(PageTable));
+    lockMem();
+    compactMemory();  // counters stay the same, only the offsets in the page table change
+    memcpy((void *)pt_copy, (void *)page_table, sizeof(PageTable));
+
+    HeapFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HEAP_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = HEAP_FILE_VERSION;
+    hdr.policy = mem->policy;
+    hdr.bytes = mem_bytes;
+    hdr.heap_words = mem->size;
+    hdr.used_words = mem->size - mem->totalFree;
+    size_t page = sysconf(_SC_PAGESIZE);
+    hdr.heap_offset = (sizeof(hdr) + sizeof(PageTable) + page - 1) / page * page;
+    hdr.checksum = heapFileChecksum(hdr, pt_copy, mem->start);
+
+    bool ok = writeFull(fd, &hdr, sizeof(hdr), 0) && writeFull(fd, pt_copy, sizeof(PageTable), sizeof(hdr)) &&
+              writeFull(fd, mem->start, hdr.used_words << 2, hdr.heap_offset);
+    if (ok && mem->totalFree != 0) {  // header and footer of the free block, the hole between them reads as zeros
+        ok = writeFull(fd, mem->start + hdr.used_words, 4, hdr.heap_offset + (hdr.used_words << 2)) &&
+             writeFull(fd, mem->end - 1, 4, hdr.heap_offset + ((hdr.heap_words - 1) << 2));
+    }
+    UNLOCK(&mem->mutex);
+    free(pt_copy);
+    close(fd);
+    if (!ok) {
+        throw runtime_error("saveHeap: Cannot write " + path);
+    }
+    MEMORY("Saved %lu live words of the heap to %s", (size_t)hdr.used_words, path.c_str());
+}
+
+void loadHeap(string path, bool is_gc_active) {
+    initLog();
+    LIBRARY("loadHeap called with path = %s", path.c_str());
+    if (num_shards != 0) {
+        throw runtime_error("loadHeap: Memory already created");
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw runtime_error("loadHeap: Cannot open " + path);
+    }
+    HeapFileHeader hdr;
+    struct stat st;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, HEAP_FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != HEAP_FILE_VERSION || hdr.used_words > hdr.heap_words || fstat(fd, &st) == -1 ||
+        (uint64_t)st.st_size < hdr.heap_offset + (hdr.heap_words << 2)) {
+        close(fd);
+        throw runtime_error("loadHeap: " + path + " is not a memlab heap file");
+    }
+    PageTable *pt = (PageTable *)malloc(sizeof(PageTable));
+    int *heap = (int *)mmap(NULL, hdr.heap_words << 2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, hdr.heap_offset);
+    bool ok = pread(fd, (void *)pt, sizeof(PageTable), sizeof(hdr)) == sizeof(PageTable) && heap != MAP_FAILED;
+    close(fd);
+    if (!ok || heapFileChecksum(hdr, pt, heap) != hdr.checksum) {
+        if (heap != MAP_FAILED) {
+            munmap(heap, hdr.heap_words << 2);
+        }
+        free(pt);
+        throw runtime_error("loadHeap: Checksum mismatch in " + path);
+    }
+    u_int now = nowMs();
+    for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {
+        pt->pt[i].site = NO_SITE;  // sites are addresses in the process that saved the heap
+        pt->pt[i].last_use = now;  // and so are the times, the objects count as just used
+    }
+
+    heap_map_len = hdr.heap_words << 2;
+    mem_bytes = hdr.bytes;
+    shards[0].mem = (Memory *)malloc(sizeof(Memory));
+    shards[0].mem->adopt(heap, hdr.heap_words, (PlacementPolicy)hdr.policy);
+    shards[0].page_table = pt;
+    num_shards = 1;
+    selectShard(0);
+    for (size_t i = 0; i < MAX_PT_ENTRIES; i++) {  // arrays that were saved compressed
+        if (pt->pt[i].valid() && pt->pt[i].raw_words != 0) {
+            statAdd(stats.compressed_arrays, 1);
+            statAdd(stats.compression_bytes_saved, (pt->pt[i].raw_words + 2 - (*mem->getAddr(pt->pt[i].addr) >> 1)) << 2);
+        }
+    }
+    initRuntime(is_gc_active, false, "");
+}
+
+// Concurrent compaction: instead of sliding every block down with the memory locked, the compactor thread moves one
+// object at a time from the top of the heap into a free block further down. The lock is only held to pick the
+// object and reserve the target block, and again to commit; the copy in between runs unlocked while the program
+// keeps reading the old block through the page table. A write to the object, or a clone of it, clears its PT_MOVING
+// bit, which makes the compactor discard the copy instead of switching the page table entry over to it. The copy
+// goes in chunks, so that a compaction with the memory locked can cancel it without waiting for all of it.
+const int COMPACTOR_SLEEP_US = 1000;
+const size_t MOVE_CHUNK_WORDS = 1024;
+
+pthread_t compactor_tid;
+atomic<bool> compactor_stop(false);
+
+// The compactor goes over each shard in passes: the live objects are sorted by address, highest first, once at the
+// start of a pass, and every relocateOne carries on from where the previous one stopped. Used by the compactor only
+struct MoveCursor {
+    vector<pair<u_int, u_int>> order;  // offset, index of the live unshared entries when the pass started
+    size_t pos;
+};
+
+MoveCursor move_cursors[MAX_SHARDS];
+
+// Moves one object of the selected shard down the heap. Returns false if there is nothing worth moving, or at the
+// end of a pass
+bool relocateOne() {
+    MoveCursor &cur = move_cursors[page_table->shard];
+    lockMem();
+    double ratio = (double)mem->totalFree / (double)(mem->largestFreeBlock() + 1);
+    if (ratio < COMPACTION_RATIO_THRESHOLD) {
+        UNLOCK(&mem->mutex);
+        cur.order.clear();
+        cur.pos = 0;
+        return false;
+    }
+    if (cur.pos == cur.order.size()) {  // start a new pass, sorting with the memory unlocked
+        cur.order.clear();
+        cur.pos = 0;
+        for (u_int i = 0; i < MAX_PT_ENTRIES; i++) {
+            u_int st = page_table->pt[i].state.load(memory_order_acquire);
+            if ((st & PT_VALID) && (st & PT_MARKED) && !isShared(i)) {
+                cur.order.push_back({page_table->pt[i].addr, i});
+            }
+        }
+        UNLOCK(&mem->mutex);
+        sort(cur.order.rbegin(), cur.order.rend());
+        return !cur.order.empty();
+    }
+    while (cur.pos < cur.order.size()) {
+        pair<u_int, u_int> c = cur.order[cur.pos++];
+        u_int idx = c.second;
+        u_int st = page_table->pt[idx].state.load(memory_order_acquire);
+        if (!(st & PT_VALID) || !(st & PT_MARKED) || isShared(idx) || page_table->pt[idx].addr != c.first) {
+            continue;  // freed, out of scope, cloned or moved since the pass started
+        }
+        int *src = mem->getAddr(c.first);
+        size_t words = (*src >> 1) - 2;
+        int *dst = mem->scanFreeBlock(mem->start, src, words);
+        if (dst == NULL) {
+            continue;
+        }
+        u_int counter = idxToCounter(idx, page_table->pt[idx].gen(), page_table->shard);
+        mem->allocateBlock(dst, words);
+        mem->move_idx = idx;
+        mem->move_dst = mem->getOffset(dst);
+        page_table->pt[idx].state.fetch_or(PT_MOVING, memory_order_relaxed);
+        mem->copying.store(true, memory_order_relaxed);
+        mem->move_cancel.store(false, memory_order_relaxed);
+        UNLOCK(&mem->mutex);
+
+        for (size_t done = 0; done < words && !mem->move_cancel.load(memory_order_relaxed); done += MOVE_CHUNK_WORDS) {
+            memcpy(dst + 1 + done, src + 1 + done, min(MOVE_CHUNK_WORDS, words - done) << 2);
+        }
+        mem->copying.store(false, memory_order_release);
+
+        lockMem();
+        if (mem->move_idx != idx) {  // cancelled by a stop-the-world compaction, which also freed the target
+            statAdd(stats.moves_aborted, 1);
+        } else if (page_table->isValid(counter) && (page_table->pt[idx].state.load(memory_order_relaxed) & PT_MOVING) &&
+                   !isShared(idx)) {
+            page_table->pt[idx].state.fetch_and(~PT_MOVING, memory_order_relaxed);
+            page_table->pt[idx].addr = mem->move_dst;
+            mem->freeBlock(src);
+            statAdd(stats.bytes_moved, words << 2);
+            statAdd(stats.moves, 1);
+            MEMORY("Moved entry %u from %p to %p", idx, src, dst);
+        } else {  // written to, cloned or freed during the copy
+            mem->freeBlock(mem->getAddr(mem->move_dst));
+            statAdd(stats.moves_aborted, 1);
+        }
+        mem->move_idx = MAX_PT_ENTRIES;
+        UNLOCK(&mem->mutex);
+        return true;
+    }
+    UNLOCK(&mem->mutex);
+    return false;
+}
+
+void *compactorThread(void *) {
+    GC("Compactor thread created");
+    while (!compactor_stop.load()) {
+        for (size_t s = 0; s < num_shards && !compactor_stop.load(); s++) {
+            selectShard(s);
+            while (!compactor_stop.load() && relocateOne()) {
+            }
+        }
+        usleep(COMPACTOR_SLEEP_US);
+    }
+    return NULL;
+}
+
+void compactorStart() {
+    LIBRARY("compactorStart called");
+    if (num_shards == 0) {
+        throw runtime_error("compactorStart: Memory not created");
+    }
+    if (shm_seg != NULL) {
+        throw runtime_error("compactorStart: Shared memory is compacted by the garbage collector only");
+    }
+    if (compactor_running.exchange(true)) {
+        return;
+    }
+    compactor_stop.store(false);
+    pthread_create(&compactor_tid, NULL, compactorThread, NULL);
+}
+
+void compactorStop() {
+    LIBRARY("compactorStop called");
+    if (!compactor_running.load()) {
+        return;
+    }
+    compactor_stop.store(true);
+    pthread_join(compactor_tid, NULL);
+    compactor_running.store(false);
+}
+
+void setCompactionMode(CompactionMode mode) {
+    LIBRARY("setCompactionMode called with mode = %d", mode);
+    if (mode == COMPACT_HOT_FIRST && !reserveHotScratch()) {
+        throw runtime_error("setCompactionMode: Cannot reserve a scratch buffer as large as the memory");
+    }
+    compaction_mode = mode;
+    if (mode != COMPACT_HOT_FIRST) {
+        releaseHotScratch();
+    }
+}
+
+void compactNow() {
+    LIBRARY("compactNow called");
+    if (num_shards == 0) {
+        throw runtime_error("compactNow: Memory not created");
+    }
+    for (size_t s = 0; s < num_shards; s++) {
+        selectShard(s);
+        lockMem();
+        compactMemory();
+        UNLOCK(&mem->mutex);
+    }
+}
@@ -3,8 +3,10 @@
 
 #include <unistd.h>
 
+#include <cstdio>
 #include <iostream>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -18,6 +20,28 @@ enum VarType {
     ARRAY
 };
 
+// Where createVar/createArr place new blocks in the heap
+enum PlacementPolicy {
+    FIRST_FIT,  // lowest addressed free block that fits
+    NEXT_FIT,   // first block that fits, searching on from the previous allocation
+    BEST_FIT    // smallest block that fits, looked up in an ordered index of free blocks
+};
+
+// Library log levels, each one includes the ones before it
+enum LogLevel {
+    LOG_OFF,
+    LOG_ERROR,
+    LOG_INFO,   // library calls
+    LOG_DEBUG,  // garbage collector, memory blocks and stacks
+    LOG_TRACE   // page table updates and word alignment
+};
+
+// How compaction lays out the live objects
+enum CompactionMode {
+    COMPACT_SLIDE,     // in address order, sliding them down over the free blocks
+    COMPACT_HOT_FIRST  // most accessed first, so that the hot objects share cache lines and pages
+};
+
 enum DataType {
     INT,
     CHAR,
@@ -109,7 +133,65 @@ struct MyType {
     }
 };
 
-void createMem(size_t bytes, bool is_gc_Active = true, bool is_profiler_active = false, string file = "memory_footprint.txt");
+// Result of tryCreateVar/tryCreateArr/tryCreateBatch
+enum MemStatus {
+    MEM_OK,
+    MEM_HARD_LIMIT,  // the allocation would take the memory in use over the hard limit
+    MEM_NO_SPACE,    // no free block large enough, even after compaction
+    MEM_PT_FULL,     // no free page table entry
+    MEM_STACK_FULL
+};
+
+// Returned by tryCreateVar/tryCreateArr, var is only a usable handle if status is MEM_OK
+struct MemResult {
+    MemStatus status;
+    MyType var;
+};
+
+// Snapshot of allocator and garbage collector statistics, all sizes in bytes
+struct MemStats {
+    size_t num_allocs[4];  // indexed by DataType
+    size_t num_frees[4];   // indexed by DataType, includes frees done by the garbage collector
+    size_t bytes_live;     // allocated blocks, including headers and footers
+    size_t bytes_free;
+    size_t bytes_live_peak;
+    size_t num_free_blocks;
+    size_t largest_free_block;
+    size_t pt_used;  // occupied page table entries
+    size_t pt_capacity;
+    size_t gc_cycles;
+    size_t objects_swept;
+    size_t pending_sweep;  // unreachable objects the collector found that no allocation has swept yet
+    size_t compactions;
+    size_t bytes_moved;  // by compaction and resizeArr
+    size_t cow_copies;   // private copies made for writes to cloned arrays
+    size_t moves;        // objects moved by the concurrent compactor
+    size_t moves_aborted;  // moves given up because the object was written to, cloned or freed during the copy
+    size_t compressed_arrays;        // cold arrays currently stored compressed
+    size_t compression_bytes_saved;  // by which bytes_live is lower thanks to them
+    size_t decompressions;
+    size_t spilled_arrays;  // arrays currently moved out to the backing file
+    size_t spill_bytes;     // of data in the backing file
+    size_t spill_faults;    // spilled arrays brought back into memory on access
+    size_t gc_pause_total_ns;
+    size_t gc_pause_max_ns;
+};
+
+// With num_shards > 1 (at most 8) the memory is split into that many shards, each with its own heap, page table and
+// lock. Threads allocate from a shard picked by thread id and fall back to the others when it is full.
+void createMem(size_t bytes, bool is_gc_Active = true, bool is_profiler_active = false, string file = "memory_footprint.txt", PlacementPolicy policy = FIRST_FIT,
+               int num_shards = 1);
+
+// Creates the memory in the named POSIX shared memory segment, or attaches to it if another process already has.
+// MyType handles can be passed between the attached processes; an object lives as long as the scope that created it.
+void createSharedMem(string name, size_t bytes, bool is_gc_active = true, PlacementPolicy policy = FIRST_FIT);
+
+// Describes one variable (len is ignored) or array for createBatch
+struct AllocSpec {
+    VarType var_type;
+    DataType data_type;
+    int len;
+};
 
 MyType createVar(DataType type);
 void assignVar(MyType &var, int val);
@@ -119,6 +201,10 @@ void assignVar(MyType &var, bool val);
 void readVar(MyType &var, void *ptr);
 
 MyType createArr(DataType type, int len);
+
+// Like createVar/createArr, but a failed allocation returns its MemStatus instead of throwing
+MemResult tryCreateVar(DataType type);
+MemResult tryCreateArr(DataType type, int len);
 void assignArr(MyType &arr, int val[]);
 void assignArr(MyType &arr, medium_int val[]);
 void assignArr(MyType &arr, char val[]);
@@ -129,6 +215,16 @@ void assignArr(MyType &arr, int index, char val);
 void assignArr(MyType &arr, int index, bool val);
 void readArr(MyType &arr, void *ptr);
 void readArr(MyType &arr, int index, void *ptr);
+// Copy-on-write clone of an array, the data is only copied when one of the handles is first assigned to
+MyType cloneArr(MyType &arr);
+// Changes the length of an array in place where possible, new elements are uninitialized. Returns the handle with the
+// new length, arr keeps its old one
+MyType resizeArr(MyType &arr, int len);
+
+// Creates n variables/arrays in one call and returns their handles in the order of specs
+vector<MyType> createBatch(const AllocSpec *specs, int n);
+// Like createBatch, but a failed allocation returns its MemStatus instead of throwing, with out left empty
+MemStatus tryCreateBatch(const AllocSpec *specs, int n, vector<MyType> &out);
 
 void freeElem(MyType &var);
 void gcActivate();
@@ -136,6 +232,72 @@ void gcActivate();
 void initScope();
 void endScope();
 
+MemStats getMemStats();
+
+// Limits on the memory in use (allocated blocks with their headers and footers, bytes_live in MemStats), in bytes or
+// as a fraction of the whole memory, 0 turns a limit off. The allocation that crosses the soft limit runs a garbage
+// collection right away and then calls the onSoftLimit callbacks with the bytes still in use; it fires again once the
+// memory in use has dropped below the limit. Allocations that would cross the hard limit fail right away, without
+// reclaiming anything: tryCreateVar, tryCreateArr and tryCreateBatch return MEM_HARD_LIMIT, the other functions
+// (createVar, createArr, createBatch, ...) throw.
+void setSoftLimit(size_t bytes);
+void setSoftLimitFraction(double fraction);
+void setHardLimit(size_t bytes);
+void setHardLimitFraction(double fraction);
+void onSoftLimit(void (*callback)(size_t bytes_live, void *arg), void *arg = NULL);
+
+// Writes the compacted heap and page table to path. loadHeap creates the memory from such a file, instead of
+// createMem, by mapping it privately as the heap; the counters in saved MyType handles refer to the same objects.
+// Objects loaded this way are not in any scope, they stay until freed with freeElem.
+void saveHeap(string path);
+void loadHeap(string path, bool is_gc_active = true);
+
+// Snapshot of the heap layout as JSON, taken in one pass with the memory locked: free block counts and bytes in
+// power-of-two size buckets, an occupancy bitmap with one bit per resolution bytes (set if any of them is allocated)
+// and the live bytes per data type. Written to file or handed to callback.
+void heapSnapshot(string file, size_t resolution = 4096);
+void heapSnapshot(void (*callback)(const string &json), size_t resolution = 4096);
+
+// Records createVar/createArr/freeElem/initScope/endScope/gcActivate calls to a file for memlab-replay.
+// Tracing also starts from createMem if the MEMLAB_TRACE environment variable names a file.
+void traceStart(string file);
+void traceStop();
+
+// Allocation site profiler. One in every sample_every createVar/createArr calls is attributed to its call site;
+// siteProfileDump prints the top sites by live bytes with their live count, allocations and average lifetime in
+// garbage collection cycles. The counts cover the sampled allocations only. Not available with createSharedMem.
+void siteProfileStart(int sample_every = 1);
+void siteProfileStop();
+void siteProfileDump(FILE *out = stdout, int top = 10);
+
+// Compacts every shard now, in the layout chosen with setCompactionMode. The heat that COMPACT_HOT_FIRST orders by
+// counts sampled reads and writes of each object, halved every 1000 garbage collection cycles. Selecting
+// COMPACT_HOT_FIRST reserves a scratch buffer as large as the memory (throwing if it cannot), so that compaction does
+// not allocate; selecting COMPACT_SLIDE releases it.
+void setCompactionMode(CompactionMode mode);
+void compactNow();
+
+// With idle_ms > 0, the garbage collector compresses CHAR and BOOLEAN arrays of at least 64 bytes that no readArr,
+// assignArr, cloneArr or resizeArr has used for that many milliseconds of wall-clock time, in place. The next such call
+// decompresses the array first. 0 (the default) turns compression off; arrays that are compressed stay so until used.
+void setColdCompression(size_t idle_ms);
+
+// Lets the memory spill to a backing file at path, which is created (truncated if it exists) and mapped into memory.
+// When an allocation finds no room even after compaction, arrays of at least 256 bytes that have not been used
+// recently are moved out to the file until the allocation fits, and the next call that uses such an array brings it
+// back. The file holds up to 16 times the size of the memory and is removed by cleanExit. Not available with
+// createSharedMem, and the memory can no longer be saved.
+void spillStart(string path);
+
+// Starts/stops a background thread that compacts the memory concurrently, one object at a time, whenever it is
+// fragmented. While it runs the garbage collector no longer compacts with the memory locked.
+void compactorStart();
+void compactorStop();
+
+// Sets the library log level. It starts out from the MEMLAB_LOG environment variable (off, error, info, debug or
+// trace, default off) when the memory is created, and logs go to stdout or the file named by MEMLAB_LOG_FILE.
+void setLogLevel(LogLevel level);
+
 void cleanExit();
 
 #endif
\ No newline at end of file
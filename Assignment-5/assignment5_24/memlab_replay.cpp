@@ -0,0 +1,176 @@
+/*
+    Replays an allocation trace recorded by memlab (see traceStart and MEMLAB_TRACE)
+    against the library as fast as possible and reports throughput, peak footprint,
+    fragmentation over time and garbage collection pauses.
+
+    Usage: memlab-replay [-p first|next|best] [-g on|off] [-i interval] [-o series_file] trace_file
+        -p  placement policy, defaults to the one the trace was recorded with
+        -g  garbage collector on/off, defaults to the recorded setting
+        -i  number of operations between fragmentation samples (default 1000)
+        -o  write the samples (ops, live bytes, fragmentation) to this file
+*/
+
+#include <getopt.h>
+
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "memlab.h"
+#include "memlab_trace.h"
+
+using namespace std;
+
+#define EXCEPTION(msg, ...) fprintf(stderr, "\x1b[31m[EXCEPTION] " msg " \x1b[0m\n", ##__VA_ARGS__);
+
+struct Sample {
+    size_t ops;
+    size_t bytes_live;
+    double frag;
+};
+
+Sample takeSample(size_t ops) {
+    MemStats s = getMemStats();
+    double frag = (s.bytes_free == 0) ? 0 : 1.0 - (double)s.largest_free_block / (double)s.bytes_free;
+    return {ops, s.bytes_live, frag};
+}
+
+int main(int argc, char *argv[]) {
+    int policy = -1, gc = -1;
+    size_t interval = 1000;
+    string series_file = "";
+    int opt;
+    while ((opt = getopt(argc, argv, "p:g:i:o:")) != -1) {
+        if (opt == 'p') {
+            if (strcmp(optarg, "first") == 0) {
+                policy = FIRST_FIT;
+            } else if (strcmp(optarg, "next") == 0) {
+                policy = NEXT_FIT;
+            } else if (strcmp(optarg, "best") == 0) {
+                policy = BEST_FIT;
+            } else {
+                EXCEPTION("Unknown placement policy %s", optarg);
+                return 1;
+            }
+        } else if (opt == 'g') {
+            gc = (strcmp(optarg, "off") != 0);
+        } else if (opt == 'i') {
+            interval = max(1L, atol(optarg));
+        } else if (opt == 'o') {
+            series_file = optarg;
+        } else {
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-p first|next|best] [-g on|off] [-i interval] [-o series_file] trace_file\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL) {
+        EXCEPTION("Cannot open %s", argv[optind]);
+        return 1;
+    }
+    TraceHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TRACE_MAGIC, 4) != 0 || hdr.version != TRACE_VERSION) {
+        EXCEPTION("%s is not a memlab trace", argv[optind]);
+        return 1;
+    }
+    vector<TraceRecord> trace;
+    TraceRecord rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        trace.push_back(rec);
+    }
+    fclose(f);
+
+    // Tracing the replay itself would overwrite the trace being read
+    unsetenv(TRACE_ENV);
+    createMem(hdr.bytes, gc == -1 ? hdr.gc_active : gc, false, "", (PlacementPolicy)(policy == -1 ? hdr.policy : policy));
+
+    unordered_map<uint32_t, MyType *> handles;  // recorded counter -> replayed variable
+    vector<Sample> samples;
+    size_t failures = 0;
+    double secs = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (size_t i = 0; i < trace.size(); i++) {
+        const TraceRecord &r = trace[i];
+        try {
+            if (r.op == TRACE_CREATE_VAR || r.op == TRACE_CREATE_ARR) {
+                MyType v = (r.op == TRACE_CREATE_VAR) ? createVar((DataType)r.data_type) : createArr((DataType)r.data_type, r.len);
+                MyType *&h = handles[r.ind];
+                delete h;
+                h = new MyType(v);
+            } else if (r.op == TRACE_FREE) {
+                auto it = handles.find(r.ind);
+                if (it != handles.end()) {
+                    freeElem(*it->second);
+                }
+            } else if (r.op == TRACE_INIT_SCOPE) {
+                initScope();
+            } else if (r.op == TRACE_END_SCOPE) {
+                endScope();
+            } else if (r.op == TRACE_GC_ACTIVATE) {
+                gcActivate();
+            } else if (r.op == TRACE_CLONE_ARR) {
+                auto it = handles.find(r.len);
+                if (it != handles.end()) {
+                    MyType v = cloneArr(*it->second);
+                    MyType *&h = handles[r.ind];
+                    delete h;
+                    h = new MyType(v);
+                }
+            } else if (r.op == TRACE_RESIZE_ARR) {
+                auto it = handles.find(r.ind);
+                if (it != handles.end()) {
+                    MyType v = resizeArr(*it->second, r.len);
+                    delete it->second;
+                    it->second = new MyType(v);
+                }
+            }
+        } catch (const runtime_error &e) {
+            EXCEPTION("Operation %zu: %s", i, e.what());
+            failures++;
+        }
+        if ((i + 1) % interval == 0) {
+            secs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            samples.push_back(takeSample(i + 1));
+            t0 = chrono::steady_clock::now();
+        }
+    }
+    secs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    samples.push_back(takeSample(trace.size()));
+
+    MemStats s = getMemStats();
+    double frag_sum = 0, frag_max = 0;
+    for (Sample &smp : samples) {
+        frag_sum += smp.frag;
+        frag_max = max(frag_max, smp.frag);
+    }
+    printf("Operations:          %zu (%zu failed)\n", trace.size(), failures);
+    printf("Replay time:         %.3f s\n", secs);
+    printf("Throughput:          %.0f ops/s\n", secs > 0 ? trace.size() / secs : 0);
+    printf("Peak footprint:      %zu bytes\n", s.bytes_live_peak);
+    printf("Fragmentation:       avg %.3f, max %.3f, final %.3f\n", frag_sum / samples.size(), frag_max, samples.back().frag);
+    printf("GC cycles:           %zu (%zu objects swept, %zu compactions, %zu bytes moved)\n", s.gc_cycles, s.objects_swept, s.compactions,
+           s.bytes_moved);
+    printf("GC pause:            total %.3f ms, max %.3f ms\n", s.gc_pause_total_ns / 1e6, s.gc_pause_max_ns / 1e6);
+
+    if (series_file != "") {
+        FILE *out = fopen(series_file.c_str(), "w");
+        if (out == NULL) {
+            EXCEPTION("Cannot open %s", series_file.c_str());
+        } else {
+            fprintf(out, "ops bytes_live fragmentation\n");
+            for (Sample &smp : samples) {
+                fprintf(out, "%zu %zu %f\n", smp.ops, smp.bytes_live, smp.frag);
+            }
+            fclose(out);
+        }
+    }
+    for (auto &h : handles) {
+        delete h.second;
+    }
+    cleanExit();
+}
@@ -0,0 +1,41 @@
+#ifndef __MEMLAB_TRACE_H
+#define __MEMLAB_TRACE_H
+
+#include <stdint.h>
+
+// On-disk format of memlab allocation traces, shared by the library and memlab-replay.
+// A trace is a TraceHeader followed by fixed size TraceRecords in the order the calls were made.
+
+#define TRACE_MAGIC "MLTR"
+#define TRACE_VERSION 1
+#define TRACE_ENV "MEMLAB_TRACE"  // createMem starts tracing to this file if the variable is set
+
+enum TraceOp {
+    TRACE_CREATE_VAR,
+    TRACE_CREATE_ARR,
+    TRACE_FREE,
+    TRACE_INIT_SCOPE,
+    TRACE_END_SCOPE,
+    TRACE_GC_ACTIVATE,
+    TRACE_RESIZE_ARR,
+    TRACE_CLONE_ARR  // len holds the counter of the array that was cloned
+};
+
+struct TraceHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t bytes;  // as passed to createMem
+    uint8_t gc_active;
+    uint8_t policy;
+    uint8_t pad[6];
+};
+
+struct TraceRecord {
+    uint8_t op;
+    uint8_t data_type;
+    uint16_t pad;
+    uint32_t ind;  // counter of the variable that was created or freed
+    uint32_t len;
+};
+
+#endif